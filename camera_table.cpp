@@ -0,0 +1,269 @@
+// camera_table.cpp: properties of all the cameras of the clip, derived from their matrices once
+// stored as separate arrays so that a single viewer can be tested against many cameras in a batch
+// a bounding volume hierarchy over the camera frusta finds the cameras that may see a given point
+
+#include "recon.hpp"
+#include <algorithm>
+#include <limits>
+#ifdef __SSE__
+	#include <xmmintrin.h>
+#endif
+
+// at most this many cameras in a leaf of the hierarchy
+const int bvhLeafSize = 4;
+
+CameraTable::CameraTable()
+{
+	count = 0;
+}
+
+// orders cameras by the center of their bounding box along a single axis
+typedef struct BoxCenterLess {
+	const std::vector<float> *boxes;
+	int axis;
+	BoxCenterLess(const std::vector<float> *b, int a):boxes(b), axis(a) {};
+	bool operator()(int a, int b) const {
+		return (*boxes)[6*a + axis] + (*boxes)[6*a + 3 + axis] < (*boxes)[6*b + axis] + (*boxes)[6*b + 3 + axis];
+	};
+} BoxCenterLess;
+
+void CameraTable::build(const std::vector<Mat> &cameras)
+{
+	TraceScope trace("buildCameraTable");
+	count = cameras.size();
+	projections = cameras;
+	centers.resize(count);
+	inverses.resize(count);
+	// element (row, col) of the projection is elements[4*row + col], the center is elements[16, ..., 19]
+	std::vector<float> elements[20];
+	for (int k=0; k<20; k++)
+		elements[k].resize(count);
+	// bounding box of each frustum: min x, y, z, max x, y, z
+	std::vector<float> boxes(6*count);
+	for (int i=0; i<count; i++) {
+		centers[i] = extractCameraCenter(cameras[i]);
+		inverses[i] = cameras[i].inv();
+		for (int r=0; r<4; r++) {
+			const float *row = cameras[i].ptr<float>(r);
+			for (int c=0; c<4; c++)
+				elements[4*r + c][i] = row[c];
+		}
+		for (int k=0; k<4; k++)
+			elements[16 + k][i] = centers[i].at<float>(k);
+
+		// the frustum is the convex hull of the camera center and the corners of its near and far plane
+		float *box = &boxes[6*i];
+		for (int k=0; k<3; k++)
+			box[k] = box[3+k] = elements[16 + k][i] / elements[19][i];
+		for (int corner=0; corner<8; corner++) {
+			float clip[4] = {(corner&1) ? 1.f : -1.f, (corner&2) ? 1.f : -1.f, (corner&4) ? 1.f : -1.f, 1.f};
+			Mat world = inverses[i] * Mat(4, 1, CV_32FC1, clip);
+			for (int k=0; k<3; k++) {
+				float coord = world.at<float>(k) / world.at<float>(3);
+				box[k] = IMIN(box[k], coord);
+				box[3+k] = IMAX(box[3+k], coord);
+			}
+		}
+	}
+
+	// split the cameras recursively at the median along the longest axis of their boxes
+	bvhCameras.resize(count);
+	for (int i=0; i<count; i++)
+		bvhCameras[i] = i;
+	bvhNodes.clear();
+	if (count > 0)
+		buildNode(boxes, 0, count);
+
+	// copy the cameras of each leaf into its packet
+	int packetCount = 0;
+	for (int n=0; n<bvhNodes.size(); n++) {
+		if (bvhNodes[n].right < 0)
+			bvhNodes[n].packet = packetCount++;
+	}
+	for (int k=0; k<20; k++)
+		packets[k].resize(4*packetCount);
+	packetCameras.resize(4*packetCount);
+	for (int n=0; n<bvhNodes.size(); n++) {
+		const BVHNode &node = bvhNodes[n];
+		if (node.right >= 0)
+			continue;
+		for (int slot=0; slot<4; slot++) {
+			bool used = node.begin + slot < node.end;
+			int camera = bvhCameras[used ? node.begin + slot : node.begin];
+			packetCameras[4*node.packet + slot] = used ? camera : -1;
+			for (int k=0; k<20; k++)
+				packets[k][4*node.packet + slot] = elements[k][camera];
+		}
+	}
+}
+
+// create the node holding cameras bvhCameras[begin, ..., end-1] and its subtree; returns the index of the node
+int CameraTable::buildNode(const std::vector<float> &boxes, int begin, int end)
+{
+	int nodeNo = bvhNodes.size();
+	bvhNodes.push_back(BVHNode());
+	BVHNode node;
+	for (int k=0; k<3; k++) {
+		node.box[k] = std::numeric_limits<float>::infinity();
+		node.box[3+k] = -std::numeric_limits<float>::infinity();
+	}
+	for (int i=begin; i<end; i++) {
+		const float *box = &boxes[6*bvhCameras[i]];
+		for (int k=0; k<3; k++) {
+			node.box[k] = IMIN(node.box[k], box[k]);
+			node.box[3+k] = IMAX(node.box[3+k], box[3+k]);
+		}
+	}
+	if (end - begin <= bvhLeafSize) {
+		node.begin = begin;
+		node.end = end;
+		node.right = -1;
+		node.packet = -1; // numbered once the tree is complete
+	} else {
+		int axis = 0;
+		for (int k=1; k<3; k++) {
+			if (node.box[3+k] - node.box[k] > node.box[3+axis] - node.box[axis])
+				axis = k;
+		}
+		int middle = (begin + end) / 2;
+		std::nth_element(bvhCameras.begin() + begin, bvhCameras.begin() + middle, bvhCameras.begin() + end, BoxCenterLess(&boxes, axis));
+		node.begin = begin;
+		node.end = end;
+		node.packet = -1;
+		// the left child directly follows its parent
+		buildNode(boxes, begin, middle);
+		node.right = buildNode(boxes, middle, end);
+	}
+	bvhNodes[nodeNo] = node;
+	return nodeNo;
+}
+
+// collect the packets of the leaves whose bounding box contains the given point
+void CameraTable::leavesNear(const float *point, std::vector<int> &result) const
+{
+	result.clear();
+	if (bvhNodes.empty())
+		return;
+	std::vector<int> stack(1, 0);
+	while (!stack.empty()) {
+		const BVHNode &node = bvhNodes[stack.back()];
+		int nodeNo = stack.back();
+		stack.pop_back();
+		bool inside = true;
+		for (int k=0; k<3; k++)
+			inside = inside && point[k] >= node.box[k] && point[k] <= node.box[3+k];
+		if (!inside)
+			continue;
+		if (node.right < 0) {
+			result.push_back(node.packet);
+		} else {
+			stack.push_back(node.right);
+			stack.push_back(nodeNo + 1);
+		}
+	}
+}
+
+// collect the cameras whose frustum bounding box contains the given point, in ascending order
+void CameraTable::camerasNear(const float *point, std::vector<int> &result) const
+{
+	std::vector<int> leaves;
+	leavesNear(point, leaves);
+	result.clear();
+	for (int l=0; l<leaves.size(); l++) {
+		for (int slot=4*leaves[l]; slot<4*leaves[l] + 4; slot++) {
+			if (packetCameras[slot] >= 0)
+				result.push_back(packetCameras[slot]);
+		}
+	}
+	std::sort(result.begin(), result.end());
+}
+
+// test a single viewer (a camera matrix) against the cameras that may see its center
+// for each such camera, store its center as projected by the viewer and the distance of the viewer's center along the camera axis
+// passed is set if the camera is within the viewer's depth range and the viewer's center is within the camera's image
+// the caller still has to check for obstacles between them
+void CameraTable::testViewer(const Mat viewer, ViewerTest &result) const
+{
+	float v[16], vc[4];
+	for (int r=0; r<4; r++) {
+		for (int c=0; c<4; c++)
+			v[4*r + c] = viewer.at<float>(r, c);
+	}
+	Mat viewerCenter = extractCameraCenter(viewer);
+	for (int k=0; k<4; k++)
+		vc[k] = viewerCenter.at<float>(k);
+	const float point[3] = {vc[0]/vc[3], vc[1]/vc[3], vc[2]/vc[3]};
+	std::vector<int> leaves;
+	leavesNear(point, leaves);
+	int n = 4*leaves.size();
+	result.index.resize(n);
+	result.viewX.resize(n);
+	result.viewY.resize(n);
+	result.viewZ.resize(n);
+	result.distance.resize(n);
+	result.passed.resize(n);
+	if (n == 0)
+		return;
+	float *viewX = &result.viewX[0], *viewY = &result.viewY[0], *viewZ = &result.viewZ[0], *distance = &result.distance[0];
+	uchar *passed = &result.passed[0];
+	#ifdef __SSE__
+	__m128 one = _mm_set1_ps(1), minusOne = _mm_set1_ps(-1), zero = _mm_setzero_ps();
+	#endif
+
+	for (int l=0; l<leaves.size(); l++) {
+		int first = 4*leaves[l], i = 4*l;
+		for (int slot=0; slot<4; slot++)
+			result.index[i + slot] = packetCameras[first + slot];
+		#ifdef __SSE__
+		// the four cameras of the leaf at once; the packets are 16-byte aligned as allocated by operator new
+		__m128 c[4], cfv[4];
+		for (int k=0; k<4; k++)
+			c[k] = _mm_load_ps(&packets[16 + k][first]);
+		for (int r=0; r<4; r++) {
+			cfv[r] = _mm_mul_ps(_mm_set1_ps(v[4*r]), c[0]);
+			for (int k=1; k<4; k++)
+				cfv[r] = _mm_add_ps(cfv[r], _mm_mul_ps(_mm_set1_ps(v[4*r + k]), c[k]));
+		}
+		__m128 x = _mm_mul_ps(_mm_load_ps(&packets[0][first]), _mm_set1_ps(vc[0])),
+		       y = _mm_mul_ps(_mm_load_ps(&packets[4][first]), _mm_set1_ps(vc[0])),
+		       w = _mm_mul_ps(_mm_load_ps(&packets[12][first]), _mm_set1_ps(vc[0]));
+		for (int k=1; k<4; k++) {
+			x = _mm_add_ps(x, _mm_mul_ps(_mm_load_ps(&packets[k][first]), _mm_set1_ps(vc[k])));
+			y = _mm_add_ps(y, _mm_mul_ps(_mm_load_ps(&packets[4 + k][first]), _mm_set1_ps(vc[k])));
+			w = _mm_add_ps(w, _mm_mul_ps(_mm_load_ps(&packets[12 + k][first]), _mm_set1_ps(vc[k])));
+		}
+		__m128 vx = _mm_div_ps(cfv[0], cfv[3]), vy = _mm_div_ps(cfv[1], cfv[3]), vz = _mm_div_ps(cfv[2], cfv[3]),
+		       dist = _mm_div_ps(w, _mm_set1_ps(vc[3])),
+		       px = _mm_div_ps(x, w), py = _mm_div_ps(y, w);
+		_mm_storeu_ps(viewX + i, vx);
+		_mm_storeu_ps(viewY + i, vy);
+		_mm_storeu_ps(viewZ + i, vz);
+		_mm_storeu_ps(distance + i, dist);
+		__m128 ok = _mm_and_ps(_mm_cmpge_ps(vz, minusOne), _mm_cmple_ps(vz, one));
+		ok = _mm_and_ps(ok, _mm_cmpge_ps(dist, zero));
+		ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(px, minusOne), _mm_cmple_ps(px, one)));
+		ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(py, minusOne), _mm_cmple_ps(py, one)));
+		int mask = _mm_movemask_ps(ok);
+		for (int slot=0; slot<4; slot++)
+			passed[i + slot] = ((mask >> slot) & 1) && result.index[i + slot] >= 0;
+		#else
+		for (int slot=0; slot<4; slot++) {
+			int j = first + slot;
+			float cfv[4];
+			for (int r=0; r<4; r++)
+				cfv[r] = v[4*r]*packets[16][j] + v[4*r + 1]*packets[17][j] + v[4*r + 2]*packets[18][j] + v[4*r + 3]*packets[19][j];
+			float x = packets[0][j]*vc[0] + packets[1][j]*vc[1] + packets[2][j]*vc[2] + packets[3][j]*vc[3],
+			      y = packets[4][j]*vc[0] + packets[5][j]*vc[1] + packets[6][j]*vc[2] + packets[7][j]*vc[3],
+			      w = packets[12][j]*vc[0] + packets[13][j]*vc[1] + packets[14][j]*vc[2] + packets[15][j]*vc[3];
+			viewX[i + slot] = cfv[0] / cfv[3];
+			viewY[i + slot] = cfv[1] / cfv[3];
+			viewZ[i + slot] = cfv[2] / cfv[3];
+			distance[i + slot] = w / vc[3];
+			float px = x / w, py = y / w;
+			// written so that NaN fails, as with SSE
+			passed[i + slot] = (viewZ[i + slot] >= -1 && viewZ[i + slot] <= 1 && distance[i + slot] >= 0 && px >= -1 && px <= 1 && py >= -1 && py <= 1)
+				&& result.index[i + slot] >= 0;
+		}
+		#endif
+	}
+}
@@ -44,23 +44,13 @@ typedef CGAL::Surface_mesh_complex_2_in_triangulation_3<STr> C2t3;
 typedef CGAL::Implicit_surface_3<Kernel, Poisson_reconstruction_function> Surface_3;
 
 // adapted from http://www.cgal.org/Manual/beta/examples/Surface_reconstruction_points_3/poisson_reconstruction_example.cpp
-Mesh poissonSurface(const Mat ipoints, const Mat normals)
+Mesh poissonSurface(PointList &points)
 {
 		// Poisson options
 		FT sm_angle = 20.0; // Min triangle angle in degrees.
 		FT sm_radius = 300; // Max triangle size w.r.t. point set average spacing.
 		FT sm_distance = 0.375; // Surface Approximation error w.r.t. point set average spacing.
 
-		PointList points;
-		points.reserve(ipoints.rows);
-		float min = 0, max = 0;
-		for (int i=0; i<ipoints.rows; i++) {
-			float const *p = ipoints.ptr<float const>(i), *n = normals.ptr<float const>(i);
-			points.push_back(Point_with_normal(Point(p[0]/p[3], p[1]/p[3], p[2]/p[3]), Vector(n[0], n[1], n[2])));
-			if (p[0]/p[3] > max) max = p[0]/p[3];
-			if (p[0]/p[3] < min) min = p[0]/p[3];
-		}
-
 		// Creates implicit function from the read points using the default solver.
 
 		// Note: this method requires an iterator over points
@@ -135,6 +125,35 @@ Mesh poissonSurface(const Mat ipoints, const Mat normals)
 		return Mesh(vertices, faces);
 }
 
+Mesh poissonSurface(const Mat ipoints, const Mat normals)
+{
+		PointList points;
+		points.reserve(ipoints.rows);
+		for (int i=0; i<ipoints.rows; i++) {
+			float const *p = ipoints.ptr<float const>(i), *n = normals.ptr<float const>(i);
+			points.push_back(Point_with_normal(Point(p[0]/p[3], p[1]/p[3], p[2]/p[3]), Vector(n[0], n[1], n[2])));
+		}
+		return poissonSurface(points);
+}
+
+#ifndef TEST_BUILD
+// convert the point store block by block, without an intermediate matrix
+Mesh poissonSurface(const PointStore &ipoints)
+{
+		PointList points;
+		points.reserve(ipoints.size());
+		for (int b=0; b<ipoints.blockCount(); b++) {
+			const float *x = ipoints.column(b, PointStore::posX), *y = ipoints.column(b, PointStore::posY),
+			            *z = ipoints.column(b, PointStore::posZ), *w = ipoints.column(b, PointStore::posW),
+			            *nx = ipoints.column(b, PointStore::normalX), *ny = ipoints.column(b, PointStore::normalY),
+			            *nz = ipoints.column(b, PointStore::normalZ);
+			for (int i=0; i<ipoints.blockLength(b); i++)
+				points.push_back(Point_with_normal(Point(x[i]/w[i], y[i]/w[i], z[i]/w[i]), Vector(nx[i], ny[i], nz[i])));
+		}
+		return poissonSurface(points);
+}
+#endif
+
 #ifdef TEST_BUILD
 int main()
 {
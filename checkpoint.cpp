@@ -0,0 +1,402 @@
+// checkpoint.cpp: saving and loading the state of an interrupted reconstruction
+// the whole state is written once per phase of an iteration; during tracking, the points of each finished
+// main camera are appended to a separate journal, so that the cost of a checkpoint does not grow with the cloud
+
+#include "recon.hpp"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h> // needed for fsync(int)
+#include <fcntl.h>
+
+// the file starts with this magic string, followed by a version number
+const char checkpointMagic[8] = {'R','E','C','O','N','C','K','P'};
+const int32_t checkpointVersion = 4;
+// the journal starts with its own magic string and the identifier of the checkpoint it continues
+const char journalMagic[8] = {'R','E','C','O','N','J','N','L'};
+
+// == BEGIN helper functions writing and reading single values, arrays and matrices ==
+template <class T>
+bool writeValue(FILE *file, const T &value)
+{
+	return fwrite(&value, sizeof(T), 1, file) == 1;
+}
+
+template <class T>
+bool readValue(FILE *file, T &value)
+{
+	return fread(&value, sizeof(T), 1, file) == 1;
+}
+
+// stored as the element count followed by the raw elements
+template <class T>
+bool writeVector(FILE *file, const std::vector<T> &vec)
+{
+	int32_t count = vec.size();
+	return writeValue(file, count) && (count == 0 || fwrite(&vec[0], sizeof(T), count, file) == count);
+}
+
+template <class T>
+bool readVector(FILE *file, std::vector<T> &vec)
+{
+	int32_t count;
+	if (!readValue(file, count) || count < 0)
+		return false;
+	vec.resize(count);
+	return count == 0 || fread(&vec[0], sizeof(T), count, file) == count;
+}
+
+// stored as rows, columns, OpenCV type and the raw data, row by row
+bool writeMat(FILE *file, const Mat mat)
+{
+	int32_t rows = mat.rows, cols = mat.cols, type = mat.type();
+	if (!writeValue(file, rows) || !writeValue(file, cols) || !writeValue(file, type))
+		return false;
+	size_t rowSize = cols * mat.elemSize();
+	for (int i=0; i<rows; i++) {
+		if (fwrite(mat.ptr<uchar>(i), 1, rowSize, file) != rowSize)
+			return false;
+	}
+	return true;
+}
+
+bool readMat(FILE *file, Mat &mat)
+{
+	int32_t rows, cols, type;
+	if (!readValue(file, rows) || !readValue(file, cols) || !readValue(file, type) || rows < 0 || cols < 0)
+		return false;
+	mat = Mat(rows, cols, type);
+	size_t size = rows * cols * mat.elemSize();
+	return size == 0 || fread(mat.data, 1, size, file) == size;
+}
+
+// stored as the point count followed by each block, column by column
+bool writeCloud(FILE *file, const PointStore &cloud)
+{
+	int32_t count = cloud.size();
+	if (!writeValue(file, count))
+		return false;
+	for (int b=0; b<cloud.blockCount(); b++) {
+		size_t length = cloud.blockLength(b);
+		for (int c=0; c<PointStore::columnCount; c++) {
+			if (fwrite(cloud.column(b, c), sizeof(float), length, file) != length)
+				return false;
+		}
+	}
+	return true;
+}
+
+bool readCloud(FILE *file, PointStore &cloud)
+{
+	int32_t count;
+	if (!readValue(file, count) || count < 0)
+		return false;
+	cloud.resize(count);
+	for (int b=0; b<cloud.blockCount(); b++) {
+		size_t length = cloud.blockLength(b);
+		for (int c=0; c<PointStore::columnCount; c++) {
+			if (fread(cloud.column(b, c), sizeof(float), length, file) != length)
+				return false;
+		}
+	}
+	return true;
+}
+
+// 64-bit FNV-1a hash of the given bytes, continuing from hash
+static uint64_t fnv(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char*)data;
+	for (size_t i=0; i<size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+// points begin, ..., begin+count-1 of the cloud, column by column, added to the hash
+bool writeRange(FILE *file, const PointStore &cloud, int begin, int count, uint64_t &hash)
+{
+	for (int c=0; c<PointStore::columnCount; c++) {
+		for (int i=begin; i<begin+count; ) {
+			int offset = i & PointStore::blockMask;
+			size_t length = IMIN(begin + count - i, PointStore::blockSize - offset);
+			const float *data = cloud.column(i >> PointStore::blockShift, c) + offset;
+			if (fwrite(data, sizeof(float), length, file) != length)
+				return false;
+			hash = fnv(hash, data, length * sizeof(float));
+			i += length;
+		}
+	}
+	return true;
+}
+
+// the cloud has to hold at least begin+count points
+bool readRange(FILE *file, PointStore &cloud, int begin, int count, uint64_t &hash)
+{
+	for (int c=0; c<PointStore::columnCount; c++) {
+		for (int i=begin; i<begin+count; ) {
+			int offset = i & PointStore::blockMask;
+			size_t length = IMIN(begin + count - i, PointStore::blockSize - offset);
+			float *data = cloud.column(i >> PointStore::blockShift, c) + offset;
+			if (fread(data, sizeof(float), length, file) != length)
+				return false;
+			hash = fnv(hash, data, length * sizeof(float));
+			i += length;
+		}
+	}
+	return true;
+}
+
+// flush the directory holding the given file, so that a rename or a new file in it survives a crash
+bool syncDirectory(const char *fileName)
+{
+	std::string dirName(fileName);
+	size_t slash = dirName.rfind('/');
+	dirName = (slash == std::string::npos) ? std::string(".") : dirName.substr(0, slash + 1);
+	int dir = open(dirName.c_str(), O_RDONLY);
+	if (dir < 0)
+		return false;
+	bool ok = fsync(dir) == 0;
+	close(dir);
+	return ok;
+}
+// stored as the shot count followed by each shot
+bool writeShots(FILE *file, const std::vector<CachedShot> &shots)
+{
+	int32_t count = shots.size();
+	bool ok = writeValue(file, count);
+	for (int i=0; ok && i<count; i++) {
+		ok = writeValue(file, shots[i].point) && writeValue(file, shots[i].normal) &&
+			writeVector(file, shots[i].filtered) && writeVector(file, shots[i].pairs);
+	}
+	return ok;
+}
+
+bool readShots(FILE *file, std::vector<CachedShot> &shots)
+{
+	int32_t count;
+	if (!readValue(file, count) || count < 0)
+		return false;
+	shots.resize(count);
+	bool ok = true;
+	for (int i=0; ok && i<count; i++) {
+		ok = readValue(file, shots[i].point) && readValue(file, shots[i].normal) &&
+			readVector(file, shots[i].filtered) && readVector(file, shots[i].pairs);
+	}
+	return ok;
+}
+
+// stored as the three arrays of main cameras, side cameras and weights
+bool writeWeights(FILE *file, const PairWeights &weights)
+{
+	std::vector<int> mains, sides;
+	std::vector<float> values;
+	for (size_t s=0; s<weights.slotCount(); s++) {
+		int i, j;
+		float weight;
+		if (weights.entry(s, i, j, weight)) {
+			mains.push_back(i);
+			sides.push_back(j);
+			values.push_back(weight);
+		}
+	}
+	return writeVector(file, mains) && writeVector(file, sides) && writeVector(file, values);
+}
+
+bool readWeights(FILE *file, PairWeights &weights)
+{
+	std::vector<int> mains, sides;
+	std::vector<float> values;
+	if (!readVector(file, mains) || !readVector(file, sides) || !readVector(file, values) ||
+	    sides.size() != mains.size() || values.size() != mains.size())
+		return false;
+	weights = PairWeights();
+	for (int i=0; i<mains.size(); i++)
+		weights(mains[i], sides[i]) = values[i];
+	return true;
+}
+// == END helper functions ==
+
+// the journal of the given checkpoint file
+static std::string journalName(const char *fileName)
+{
+	std::string name(fileName);
+	name.append(".bundles");
+	return name;
+}
+
+// tells the journal written after a checkpoint from the journals of the previous ones
+static uint64_t journalId(const Checkpoint &checkpoint)
+{
+	int32_t pointCount = checkpoint.cloud->size(), finishedCount = checkpoint.finishedMains.size(), faceCount = checkpoint.meshFaces.rows;
+	uint64_t id = 0xCBF29CE484222325ULL;
+	id = fnv(id, &checkpoint.iteration, sizeof(checkpoint.iteration));
+	id = fnv(id, &checkpoint.phase, sizeof(checkpoint.phase));
+	id = fnv(id, &checkpoint.rngState, sizeof(checkpoint.rngState));
+	id = fnv(id, &pointCount, sizeof(pointCount));
+	id = fnv(id, &finishedCount, sizeof(finishedCount));
+	id = fnv(id, &faceCount, sizeof(faceCount));
+	return id;
+}
+
+// write the checkpoint into a temporary file and then move it over the given file
+// so that a crash at any moment leaves at least the previous checkpoint intact
+// in the tracking phase, an empty journal for appendCheckpoint is started afterwards
+bool saveCheckpoint(const char *fileName, const Checkpoint &checkpoint)
+{
+	std::string tempName(fileName);
+	tempName.append(".tmp");
+	FILE *file = fopen(tempName.c_str(), "wb");
+	if (!file)
+		return false;
+
+	bool ok = fwrite(checkpointMagic, 1, sizeof(checkpointMagic), file) == sizeof(checkpointMagic) &&
+		writeValue(file, checkpointVersion) &&
+		writeValue(file, checkpoint.iteration) &&
+		writeValue(file, checkpoint.phase) &&
+		writeValue(file, checkpoint.rngState) &&
+		writeValue(file, checkpoint.sceneHash) &&
+		writeValue(file, checkpoint.frameCount) &&
+		writeValue(file, checkpoint.width) &&
+		writeValue(file, checkpoint.height) &&
+		writeVector(file, checkpoint.alphaVals);
+
+	// camera bundles: count, then (main camera, side camera count, side cameras...) for each
+	int32_t bundleCount = checkpoint.chosenCameras.size();
+	ok = ok && writeValue(file, bundleCount);
+	for (int i=0; ok && i<bundleCount; i++) {
+		int32_t mainCamera = checkpoint.chosenCameras[i].first;
+		ok = writeValue(file, mainCamera) && writeVector(file, checkpoint.chosenCameras[i].second);
+	}
+
+	ok = ok && writeShots(file, checkpoint.shotCache) && writeWeights(file, checkpoint.pairWeights);
+
+	uint64_t id = journalId(checkpoint);
+	ok = ok && writeValue(file, id) &&
+		writeVector(file, checkpoint.finishedMains) &&
+		writeMat(file, checkpoint.meshVertices) &&
+		writeMat(file, checkpoint.meshFaces) &&
+		writeCloud(file, *checkpoint.cloud);
+
+	// make sure the data are on the disk before the old checkpoint gets replaced
+	ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+	ok = (fclose(file) == 0) && ok;
+	if (!ok) {
+		remove(tempName.c_str());
+		return false;
+	}
+	// the rename itself is only durable once the directory is flushed
+	if (rename(tempName.c_str(), fileName) != 0 || !syncDirectory(fileName))
+		return false;
+
+	// a journal left from the previous checkpoint does not match its identifier, so it is ignored even if this fails
+	std::string journal = journalName(fileName);
+	if (checkpoint.phase != Checkpoint::tracking) {
+		remove(journal.c_str());
+		return true;
+	}
+	file = fopen(journal.c_str(), "wb");
+	if (!file)
+		return false;
+	ok = fwrite(journalMagic, 1, sizeof(journalMagic), file) == sizeof(journalMagic) && writeValue(file, id) &&
+		fflush(file) == 0 && fsync(fileno(file)) == 0;
+	ok = (fclose(file) == 0) && ok;
+	return ok && syncDirectory(journal.c_str());
+}
+
+// append the points begin, ..., size-1 of the cloud, triangulated from the given main camera, to the journal of the checkpoint
+// each entry is the main camera, the point count, the points column by column and a hash of all that
+bool appendCheckpoint(const char *fileName, int mainCamera, const PointStore &cloud, int begin)
+{
+	std::string journal = journalName(fileName);
+	FILE *file = fopen(journal.c_str(), "ab");
+	if (!file)
+		return false;
+	int32_t camera = mainCamera, count = cloud.size() - begin;
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	hash = fnv(hash, &camera, sizeof(camera));
+	hash = fnv(hash, &count, sizeof(count));
+	bool ok = writeValue(file, camera) && writeValue(file, count) &&
+		writeRange(file, cloud, begin, count, hash) &&
+		writeValue(file, hash);
+	ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+	ok = (fclose(file) == 0) && ok;
+	return ok;
+}
+
+// add the main cameras and points of the journal to a loaded checkpoint
+// an entry cut short by a crash, and anything after it, is left out
+static void replayJournal(const char *fileName, uint64_t id, Checkpoint &checkpoint)
+{
+	std::string journal = journalName(fileName);
+	FILE *file = fopen(journal.c_str(), "rb");
+	if (!file)
+		return;
+	char magic[sizeof(journalMagic)];
+	uint64_t savedId;
+	bool ok = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+		memcmp(magic, journalMagic, sizeof(magic)) == 0 &&
+		readValue(file, savedId) && savedId == id;
+	while (ok) {
+		int32_t camera, count;
+		if (!readValue(file, camera) || !readValue(file, count) || count < 0)
+			break;
+		uint64_t hash = 0xCBF29CE484222325ULL, savedHash;
+		hash = fnv(hash, &camera, sizeof(camera));
+		hash = fnv(hash, &count, sizeof(count));
+		int begin = checkpoint.cloud->size();
+		checkpoint.cloud->resize(begin + count);
+		if (!readRange(file, *checkpoint.cloud, begin, count, hash) || !readValue(file, savedHash) || savedHash != hash) {
+			checkpoint.cloud->resize(begin);
+			break;
+		}
+		checkpoint.finishedMains.push_back(camera);
+	}
+	fclose(file);
+}
+
+// read a checkpoint written by saveCheckpoint; returns false if the file is missing or damaged
+// the points are loaded into checkpoint.cloud, which must be set
+bool loadCheckpoint(const char *fileName, Checkpoint &checkpoint)
+{
+	FILE *file = fopen(fileName, "rb");
+	if (!file)
+		return false;
+
+	char magic[sizeof(checkpointMagic)];
+	int32_t version;
+	bool ok = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+		memcmp(magic, checkpointMagic, sizeof(magic)) == 0 &&
+		readValue(file, version) && version == checkpointVersion &&
+		readValue(file, checkpoint.iteration) &&
+		readValue(file, checkpoint.phase) &&
+		readValue(file, checkpoint.rngState) &&
+		readValue(file, checkpoint.sceneHash) &&
+		readValue(file, checkpoint.frameCount) &&
+		readValue(file, checkpoint.width) &&
+		readValue(file, checkpoint.height) &&
+		readVector(file, checkpoint.alphaVals);
+
+	int32_t bundleCount;
+	ok = ok && readValue(file, bundleCount) && bundleCount >= 0;
+	checkpoint.chosenCameras.clear();
+	for (int i=0; ok && i<bundleCount; i++) {
+		int32_t mainCamera;
+		std::vector<int> sideCameras;
+		ok = readValue(file, mainCamera) && readVector(file, sideCameras);
+		checkpoint.chosenCameras.push_back(numberedVector(mainCamera, sideCameras));
+	}
+
+	ok = ok && readShots(file, checkpoint.shotCache) && readWeights(file, checkpoint.pairWeights);
+
+	uint64_t id;
+	ok = ok && readValue(file, id) &&
+		readVector(file, checkpoint.finishedMains) &&
+		readMat(file, checkpoint.meshVertices) &&
+		readMat(file, checkpoint.meshFaces) &&
+		readCloud(file, *checkpoint.cloud);
+	fclose(file);
+	if (ok && checkpoint.phase == Checkpoint::tracking)
+		replayJournal(fileName, id, checkpoint);
+	return ok;
+}
@@ -9,6 +9,7 @@
 #include <getopt.h>
 #include <cstdio>
 #include <libgen.h> // needed for dirname(char*)
+#include <unistd.h> // needed for sysconf(int)
 const char dirDelimiter = '/';
 using namespace cv; // sorry for this...
 
@@ -25,8 +26,28 @@ Configuration::Configuration(int argc, char** argv)
 	iterationCount = 2;
 	sceneResolution = 1;
 	cameraThreshold = 10.;
+	coverageTarget = 0;
 	scalingFactor = 1.;
 	skipFrames = 1;
+	keyframeThreshold = 0;
+	incrementalTolerance = 0;
+	threadCount = 1;
+	pipelineDepth = 0;
+	checkpointFile = NULL;
+	resume = false;
+	traceFile = NULL;
+	debugWriters = 2;
+	debugContainer = NULL;
+	frameCacheSize = 0;
+	decodeThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	computeThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	undistort = false;
+	reader = NULL;
+	frameCache = NULL;
+	pyramids = NULL;
+	workers = NULL;
+	scene = NULL;
+	bool compileScene = false;
 	
 	// parse all command line options
 	while (1) {
@@ -36,10 +57,25 @@ Configuration::Configuration(int argc, char** argv)
 			{"initial-mesh",   required_argument, 0,  'm' },
 			{"output",  required_argument, 0,  'o' },
 			{"camera-threshold", required_argument, 0,  'c' },
+			{"coverage", required_argument, 0,  'g' },
 			{"estimate-exposure", no_argument, 0,  'e' },
 			{"iterations", required_argument, 0, 'n' },
 			{"scale", required_argument, 0, 's' },
 			{"skip-frames", required_argument, 0, 'k' },
+			{"keyframes", required_argument, 0, 'K' },
+			{"incremental", required_argument, 0, 'I' },
+			{"threads", required_argument, 0, 't' },
+			{"pipeline", required_argument, 0, 'p' },
+			{"checkpoint", required_argument, 0, 'C' },
+			{"resume", no_argument, 0, 'r' },
+			{"trace", required_argument, 0, 'T' },
+			{"debug-writers", required_argument, 0, 'w' },
+			{"debug-container", required_argument, 0, 'D' },
+			{"frame-cache", required_argument, 0, 'M' },
+			{"decode-threads", required_argument, 0, 'd' },
+			{"compute-threads", required_argument, 0, 'j' },
+			{"compile-scene", no_argument, 0, 'S' },
+			{"undistort", no_argument, 0, 'u' },
 			{"farneback",   no_argument, 0,  'f' },
 			{"verbose", no_argument,       0,  'v' },
 			{"hyper-verbose", no_argument,       0,  'V' },
@@ -47,7 +83,7 @@ Configuration::Configuration(int argc, char** argv)
 			{0,         0,                 0,  0 }
 		};
 		
-		char c = getopt_long(argc, argv, "i:m:o:c:en:s:k:fvVh", long_options, &option_index);
+		char c = getopt_long(argc, argv, "i:m:o:c:g:en:s:k:K:I:t:p:C:rT:w:D:M:d:j:SufvVh", long_options, &option_index);
 		if (c == -1)
 			break;
 		
@@ -68,6 +104,14 @@ Configuration::Configuration(int argc, char** argv)
 				cameraThreshold = atof(optarg);
 				break;
 			
+			case 'g':
+				coverageTarget = atof(optarg);
+				if (coverageTarget < 0)
+					coverageTarget = 0;
+				if (coverageTarget > 1)
+					coverageTarget = 1;
+				break;
+			
 			case 'e':
 				doEstimateExposure = true;
 				break;
@@ -88,6 +132,79 @@ Configuration::Configuration(int argc, char** argv)
 				skipFrames = atoi(optarg);
 				break;
 			
+			case 'K':
+				keyframeThreshold = atof(optarg);
+				if (keyframeThreshold < 0)
+					keyframeThreshold = 0;
+				break;
+			
+			case 'I':
+				incrementalTolerance = atof(optarg);
+				if (incrementalTolerance < 0)
+					incrementalTolerance = 0;
+				break;
+			
+			case 't':
+				threadCount = atoi(optarg);
+				if (threadCount < 1)
+					threadCount = 1;
+				break;
+			
+			case 'p':
+				pipelineDepth = atoi(optarg);
+				if (pipelineDepth < 0)
+					pipelineDepth = 0;
+				break;
+			
+			case 'C':
+				checkpointFile = optarg;
+				break;
+			
+			case 'r':
+				resume = true;
+				break;
+			
+			case 'T':
+				traceFile = optarg;
+				break;
+			
+			case 'w':
+				debugWriters = atoi(optarg);
+				if (debugWriters < 0)
+					debugWriters = 0;
+				break;
+			
+			case 'D':
+				debugContainer = optarg;
+				break;
+			
+			case 'S':
+				compileScene = true;
+				break;
+			
+			case 'u':
+				undistort = true;
+				break;
+			
+			case 'd':
+				decodeThreads = atoi(optarg);
+				if (decodeThreads < 1)
+					decodeThreads = 1;
+				break;
+			
+			case 'j':
+				computeThreads = atoi(optarg);
+				if (computeThreads < 1)
+					computeThreads = 1;
+				break;
+			
+			case 'M':
+				{
+					int megabytes = atoi(optarg);
+					frameCacheSize = (megabytes > 0) ? (size_t)megabytes << 20 : 0;
+				}
+				break;
+			
 			case 'f':
 				useFarneback = true;
 				break;
@@ -106,140 +223,240 @@ Configuration::Configuration(int argc, char** argv)
 				printf("Usage: recon [OPTIONS] [INPUT_FILE]\n");
 				printf("Reconstructs dense geometry from given YAML scene calibration and video\n\n");
 				printf("  -c, --camera-threshold=f  use given threshold for camera selection (default: 10)\n");
+				printf("  -C, --checkpoint=s        save progress to given file after each main camera (by default not set)\n");
+				printf("  -d, --decode-threads=i    decode the clip using given number of threads (default: number of processors)\n");
+				printf("  -D, --debug-container=s   with -V, store all debugging images in given file as raw floats, followed by an index (by default not set)\n");
 				printf("  -e, --estimate-exposure   try to normalize exposure over time (default: false)\n");
 				printf("  -f, --farneback           use Farneback's algorithm for optical flow, intsead of Horn & Schunck's (default: false)\n");
+				printf("  -g, --coverage=f          in camera selection, take shots until the chosen camera pairs see this fraction of the surface, or until they stop adding pairs (0 = always 200 shots, which is the default)\n");
 				printf("  -h, --help                print this message and exit\n");
 				printf("  -i, --input=s             input configuration file name (.yaml, usually exported from Blender; default: output.obj)\n");
+				printf("  -j, --compute-threads=i   run the point filtering, exposure estimation and co-visibility graph on given number of threads (default: number of processors)\n");
+				printf("  -I, --incremental=f       from the second iteration on, keep the camera selection where the mesh moved less than f times its size (default: 0, off)\n");
 				printf("  -k, --skip-frames=i       use only every n-th frame of the sequence (default: 1)\n");
+				printf("  -K, --keyframes=f         use only frames whose baseline (relative to scene distance) or rotation (in radians) from the previous one used exceeds f, or which share few points with it (default: 0, off)\n");
 				printf("  -m, --input-mesh=s        load initial scene estimate from given file (.obj, by default not set)\n");
+				printf("  -M, --frame-cache=i       decode frames on demand, keeping at most i megabytes of them in memory (default: 0, decode the whole clip at once)\n");
 				printf("  -n, --iterations=i        maximal iteration count of surface reconstruction (default: 2)\n");
 				printf("  -o, --output=s            output mesh file name (.obj)\n");
+				printf("  -p, --pipeline=i          overlap rendering, optical flow (on --threads) and triangulation, with i images queued between them (default: 0, off)\n");
+				printf("  -r, --resume              continue from the file given by --checkpoint\n");
 				printf("  -s, --scale=f             downsample the input video by a given factor (default: 1.0)\n");
+				printf("  -S, --compile-scene       save the scene from the input file in a binary format (.yaml.scene) that loads faster, and exit\n");
+				printf("  -t, --threads=i           track main cameras in parallel, each thread with its own rendering context; with --pipeline, number of optical flow threads (default: 1)\n");
+				printf("  -T, --trace=s             save the timing of each stage to given file (.json, Chrome trace format; by default not set)\n");
+				printf("  -u, --undistort           remove the lens distortion from the frames, caching the remap table in .yaml.undistort (default: false)\n");
 				printf("  -v, --verbose             print current task and summarize its results during computation\n");
 				printf("  -V, --hyper-verbose       print out what comes to mind, and save all images at hand\n");
+				printf("  -w, --debug-writers=i     with -V, save the images in background using given number of threads (default: 2, 0 = save directly)\n");
 				exit(0);
 				break;
 		}
 	}
 	
+	if (resume && !checkpointFile) {
+		fprintf(stderr, "Cannot resume without a --checkpoint file, exiting.\n");
+		exit(1);
+	}
+	
 	// an argument without a preceding identifier is treated as input YAML file name
 	if (optind < argc) {
 		inFileName = argv[optind];
 	}
 	
-	// read the given YAML configuration file
+	// read the given YAML configuration file, or its compiled version if it is up to date
 	if (!inFileName) {
 		fprintf(stderr, "No configuration YAML file given, exiting.\n");
 		exit(1);
 	}
-	FileStorage fs(inFileName, FileStorage::READ);
-	if (!fs.isOpened()) {
-		fprintf(stderr, "Cannot read file %s, exiting.\n", inFileName);
-		exit(1);
+	uint64_t yamlHash = hashFile(inFileName);
+	sceneHash = yamlHash;
+	string compiledName(inFileName);
+	compiledName.append(".scene");
+	scene = new Scene();
+	if (compileScene || !scene->loadCompiled(compiledName.c_str(), yamlHash)) {
+		FileStorage fs(inFileName, FileStorage::READ);
+		if (!fs.isOpened()) {
+			fprintf(stderr, "Cannot read file %s, exiting.\n", inFileName);
+			exit(1);
+		}
+		delete scene;
+		scene = new Scene();
+		if (!scene->loadYaml(fs)) {
+			fprintf(stderr, "Invalid scene in file %s, exiting.\n", inFileName);
+			exit(1);
+		}
+		if (compileScene) {
+			if (!scene->saveCompiled(compiledName.c_str(), yamlHash)) {
+				fprintf(stderr, "Cannot write file %s, exiting.\n", compiledName.c_str());
+				exit(1);
+			}
+			printf("Compiled scene saved to %s\n", compiledName.c_str());
+			exit(0);
+		}
+	} else if (verbosity >= 2) {
+		printf(" Loaded compiled scene %s\n", compiledName.c_str());
 	}
 	
-	// parse general clip properties
-	FileNode nodeClip = fs["clip"];
-	nodeClip["width"] >> width;
-	nodeClip["height"] >> height;
+	// general clip properties
+	width = scene->width;
+	height = scene->height;
 	
 	if (fmod(width, scalingFactor) > 0 || fmod(height, scalingFactor) > 0) {
 		fprintf(stderr, "You requested downscaling the video by a factor that the frame dimensions are not divisible by. This may cause instability of the program.\n");
 	}
 	
- 	string clipPathRel;
-	nodeClip["path"] >> clipPathRel;
 	string clipPath(dirname(inFileName));
 	clipPath.push_back(dirDelimiter);
-	clipPath.append(clipPathRel);
-	nodeClip["center-x"] >> centerX;
-	nodeClip["center-y"] >> centerY;
+	clipPath.append(scene->clipPath);
+	centerX = scene->centerX;
+	centerY = scene->centerY;
 	if (scalingFactor != 1 && scalingFactor != 0) {
 		width /= scalingFactor;
 		height /= scalingFactor;
 		centerX /= scalingFactor;
 		centerY /= scalingFactor;
 	}
-	nodeClip["distortion"] >> lensDistortion;
+	lensDistortion = scene->distortion;
 	
-	// read the video sequence
-	VideoCapture clip(clipPath);
-	if (!clip.isOpened()) {
+	// open the video sequence
+	reader = new FrameReader(clipPath, width, height);
+	if (!reader->isOpened()) {
 		printf("Cannot read clip %s, exiting.\n", clipPath.c_str());
 		exit(1);
 	}
-	int frameCount = clip.get(CV_CAP_PROP_FRAME_COUNT);
-
-	FileNode tracks = fs["tracks"];
-	bundles = Mat(0, 4, CV_32FC1);
-	for (FileNodeIterator it = tracks.begin(); it != tracks.end(); it++){
-		Mat bundle;
-		(*it)["bundle"] >> bundle;
-		vector<int> enabledFrames;
-		(*it)["frames-enabled"] >> enabledFrames;
-		{
-			int writeIndex = 0;
-			for (int i=0; i<enabledFrames.size(); i++) {
-				if ((enabledFrames[i] - 1)%skipFrames == 0) {
-					enabledFrames[writeIndex] = (enabledFrames[i] - 1) / skipFrames;
-					writeIndex += 1;
-				}
-			}
-			enabledFrames.resize(writeIndex);
-		}
-		std::set<int> enabledFramesSet(enabledFrames.begin(), enabledFrames.end());
-		bundlesEnabled.push_back(enabledFramesSet);
-		bundle = bundle.t();
-		bundles.push_back(bundle);
+	int frameCount = reader->clipLength();
+	if (undistort) {
+		// the table also scales the frames down, and is shared by all the threads decoding them
+		string mapName(inFileName);
+		mapName.append(".undistort");
+		Mat map1, map2;
+		undistortionMaps(mapName.c_str(), lensDistortion, width, height, scene->width, scene->height, centerX, centerY, map1, map2);
+		reader->setUndistortion(map1, map2, scene->width, scene->height);
 	}
-	//bundles = bundles.t();
 
-	FileNode camera = fs["camera"];
+	// the bundles are used directly from the scene
+	bundles = Mat(scene->trackCount, 4, CV_32FC1, (void*)scene->bundles);
+
 	cameras.resize(frameCount);
 	nearVals.resize(frameCount);
 	farVals.resize(frameCount);
 	int trackedFrameCount = -1;
-	for (FileNodeIterator cit = camera.begin(); cit != camera.end(); cit ++)	{
-		int fi;
-		(*cit)["frame"] >> fi;
+	for (int ci = 0; ci < scene->cameraCount; ci++) {
+		int fi = scene->cameraFrames[ci];
 		assert (fi > 0 && fi <= frameCount);
 		fi -= 1;
 		if (fi % skipFrames)
 			continue;
 		fi /= skipFrames;
-		(*cit)["near"] >> nearVals[fi];
-		(*cit)["far"] >> farVals[fi];
-		(*cit)["projection"] >> cameras[fi];
+		nearVals[fi] = scene->nearVals[ci];
+		farVals[fi] = scene->farVals[ci];
+		cameras[fi] = Mat(4, 4, CV_32FC1, (void*)(scene->projections + 16*ci));
 		if (trackedFrameCount <= fi)
 			trackedFrameCount = fi+1;
 	}
 	for (int i=0; i<trackedFrameCount/skipFrames; i++) {
 		assert (nearVals[i] > 0 && farVals[i] > 0);
 	}
+	// only the enabled frames that are not skipped are kept
 	cameras.resize(trackedFrameCount);
 	nearVals.resize(trackedFrameCount);
 	farVals.resize(trackedFrameCount);
+	std::vector<int> clipFrames(trackedFrameCount);
+	for (int i=0; i<trackedFrameCount; i++)
+		clipFrames[i] = i * skipFrames;
+	visibility.build(*scene, clipFrames);
+	if (keyframeThreshold > 0) {
+		// the cameras are known before decoding, so only the keyframes ever get decoded
+		std::vector<int> keyframes = selectKeyframes();
+		for (int i=0; i<keyframes.size(); i++) {
+			int fi = keyframes[i];
+			cameras[i] = cameras[fi];
+			nearVals[i] = nearVals[fi];
+			farVals[i] = farVals[fi];
+			clipFrames[i] = clipFrames[fi];
+		}
+		if (verbosity >= 2)
+			printf(" Selected %i keyframes out of %i frames\n", (int)keyframes.size(), trackedFrameCount);
+		trackedFrameCount = keyframes.size();
+		cameras.resize(trackedFrameCount);
+		nearVals.resize(trackedFrameCount);
+		farVals.resize(trackedFrameCount);
+		clipFrames.resize(trackedFrameCount);
+		visibility.build(*scene, clipFrames);
+	}
+	reader->setFrames(clipFrames);
+	workers = new WorkerPool(computeThreads);
+	table.build(cameras);
+	{
+		string graphName(inFileName);
+		graphName.append(".covisibility");
+		bool cached = graph.build(visibility, table, *workers, graphName.c_str());
+		if (verbosity >= 2)
+			printf(" Co-visibility graph of %i cameras with %i edges%s\n", graph.frameCount, (int)graph.neighbors.size()/2, cached ? " loaded from cache" : "");
+	}
 	
-	frames.resize(trackedFrameCount);
-	// Cache the whole clip into memory
-	for (int fi = 0; fi < trackedFrameCount; fi++) {
-		Mat frame;
-		clip.read(frame);
-		// todo: undistort!
-		if (frame.rows != height || frame.cols != width)
-			cv::resize(frame, frames[fi], cv::Size(width, height), CV_INTER_AREA);
-		else
-			frame.copyTo(frames[fi]);
-		for(int skip=fi*skipFrames+1; skip < (fi+1)*skipFrames && skip < frameCount; skip++)
-			clip.read(frame);
+	if (frameCacheSize == 0) {
+		// Cache the whole clip into memory
+		frames.resize(trackedFrameCount);
+		reader->readAll(frames, decodeThreads);
 	}
 	
-	if (doEstimateExposure) {
+	if (doEstimateExposure)
 		estimateExposure();
-	} else {
+	if (frameCacheSize == 0) {
 		for (int i=0; i<frames.size(); i++)
-			cv::cvtColor(frames[i], frames[i], CV_BGR2GRAY);
+			frames[i] = normalizeFrame(frames[i], exposure, i);
+		delete reader;
+		reader = NULL;
+	} else {
+		// decode the frames only when needed, the exposure gets applied to each of them
+		frameCache = new FrameCache(reader, exposure, frameCacheSize);
 	}
+	// enough for the main frames being tracked at the same time
+	pyramids = new PyramidCache(2 * IMAX(threadCount, 1));
+}
+
+// choose the frames that bring enough new information, comparing each one to the last chosen one
+// returns their indices in ascending order; the first and the last frame are always kept
+std::vector<int> Configuration::selectKeyframes()
+{
+	// the keyframes need not share more than this fraction of the points
+	const float minOverlap = 0.5;
+	int frameCount = cameras.size();
+	Mat points = dehomogenize(bundles);
+	std::vector<int> keyframes;
+	Mat keyCenter, keyAxis;
+	float keyDistance = 1;
+	for (int i=0; i<frameCount; i++) {
+		Mat center = dehomogenize(extractCameraCenter(camera(i)).t());
+		// the row giving the depth of each point is a normal of the image plane
+		Mat axis;
+		normalize(camera(i).row(3).colRange(0,3), axis);
+		if (!keyframes.empty() && i < frameCount-1) {
+			float baseline = norm(center - keyCenter) / keyDistance;
+			float angle = acos(IMIN(IMAX(axis.dot(keyAxis), -1.), 1.));
+			// points of the last keyframe that are enabled in this frame, too
+			int key = keyframes.back(), shared = 0, keyPoints = visibility.frameStart[key+1] - visibility.frameStart[key];
+			for (int k=visibility.frameStart[key]; k<visibility.frameStart[key+1]; k++)
+				shared += visibility.visible(visibility.frameTracks[k], i);
+			bool overlapping = keyPoints == 0 || shared >= minOverlap * keyPoints;
+			if (baseline < keyframeThreshold && angle < keyframeThreshold && overlapping)
+				continue;
+		}
+		keyframes.push_back(i);
+		keyCenter = center;
+		keyAxis = axis;
+		// the baseline is relative to the mean distance of the points seen from this frame
+		double distanceSum = 0;
+		int distanceCount = 0;
+		for (int k=visibility.frameStart[i]; k<visibility.frameStart[i+1]; k++) {
+			distanceSum += norm(points.row(visibility.frameTracks[k]) - center);
+			distanceCount ++;
+		}
+		keyDistance = (distanceCount > 0 && distanceSum > 0) ? distanceSum / distanceCount : 1;
+	}
+	return keyframes;
 }
 
 // applies radial distortion to the supplied points
@@ -259,134 +476,205 @@ void cameraToScreen(Mat points, const vector<float> lensDistortion, float aspect
 const Mat Configuration::projectPoints(const int frameNo) {
 	Mat projectedPoints = (camera(frameNo) * bundles.t()).t();
 	Mat cartesianPoints = dehomogenize(projectedPoints);
-	cameraToScreen(cartesianPoints, lensDistortion, (float)height/(float)width);
+	// undistorted frames match the cameras as they are
+	if (!undistort)
+		cameraToScreen(cartesianPoints, lensDistortion, (float)height/(float)width);
 	return cartesianPoints;
 }
 
-// Estimates exposure of each frame using the initial point cloud and normalizes the frames according to it
+// the linear system solved by estimateExposure, shared by its parallel loops
+// each valid sample is a row of sampledColor; exposure of its frame times the sample should equal the brightness of its point
+typedef struct {
+	int ch;
+	Mat sampledColor; // samples in rows, channels in columns
+	std::vector<int> frameRows; // samples of frame i are the rows frameRows[i], ..., frameRows[i+1]-1
+	std::vector<int> sampleTrack; // point of each sample
+	std::vector<int> trackStart, trackRows, trackFrames; // samples of each point (CSR) and their frames
+	std::vector<Mat> normalInverses; // pseudo-inverse of the normal matrix of each frame, factored once
+	Mat exposure; // channels in rows, frames in columns
+	std::vector<float> brightness; // of each point
+	std::vector<double> pointSums, frameChanges, frameNorms, frameErrors; // per-item partial results, summed in order
+	float omega; // overrelaxation
+} ExposureSystem;
+
+// imagine that exposure is correct: set each point's brightness to the average of its exposed samples
+static void solvePoints(int begin, int end, void *arg)
+{
+	ExposureSystem &sys = *(ExposureSystem*)arg;
+	for (int j=begin; j<end; j++) {
+		double sum = 0.;
+		for (int t=sys.trackStart[j]; t<sys.trackStart[j+1]; t++) {
+			const float *sc = sys.sampledColor.ptr<float>(sys.trackRows[t]);
+			for (char c=0; c<sys.ch; c++)
+				sum += sc[c] * sys.exposure.at<float>(c, sys.trackFrames[t]);
+		}
+		int weightSum = sys.trackStart[j+1] - sys.trackStart[j];
+		sys.pointSums[j] = sum;
+		sys.brightness[j] = (weightSum > 0) ? sum / weightSum : 0.;
+	}
+}
+
+// imagine that point colors are correct: solve the least squares of each frame using its factored normal equations
+static void solveFrames(int begin, int end, void *arg)
+{
+	ExposureSystem &sys = *(ExposureSystem*)arg;
+	for (int i=begin; i<end; i++) {
+		Mat rhs = Mat::zeros(sys.ch, 1, CV_64FC1);
+		for (int r=sys.frameRows[i]; r<sys.frameRows[i+1]; r++) {
+			const float *sc = sys.sampledColor.ptr<float>(r);
+			for (char c=0; c<sys.ch; c++)
+				rhs.at<double>(c) += sc[c] * sys.brightness[sys.sampleTrack[r]];
+		}
+		Mat solution = sys.normalInverses[i] * rhs;
+		double change = 0., norm = 0.;
+		for (char c=0; c<sys.ch; c++) {
+			float oldExposure = sys.exposure.at<float>(c, i);
+			float newExposure = solution.at<double>(c) * (1+sys.omega) - oldExposure * sys.omega;
+			change += (newExposure - oldExposure) * (newExposure - oldExposure);
+			norm += newExposure * newExposure;
+			sys.exposure.at<float>(c, i) = newExposure;
+		}
+		double error = 0.;
+		for (int r=sys.frameRows[i]; r<sys.frameRows[i+1]; r++) {
+			const float *sc = sys.sampledColor.ptr<float>(r);
+			double residual = -sys.brightness[sys.sampleTrack[r]];
+			for (char c=0; c<sys.ch; c++)
+				residual += sc[c] * sys.exposure.at<float>(c, i);
+			error += residual * residual;
+		}
+		sys.frameChanges[i] = change;
+		sys.frameNorms[i] = norm;
+		sys.frameErrors[i] = sqrt(error) / (sys.frameRows[i+1] - sys.frameRows[i]);
+	}
+}
+
+// Estimates exposure of each frame using the initial point cloud; the frames get normalized according to it by normalizeFrame()
+// alternates between solving the brightness of points and the exposure of frames, both in parallel
 void Configuration::estimateExposure()
 {
 	if (verbosity >= 1)
 		printf("Estimating exposure values...\n");
 	
 	int frameCount = cameras.size(), pointCount = bundles.rows;
-	char ch = frames[0].channels();
-	Mat sampledColor(frameCount*pointCount, ch, CV_32FC1); // measured brightness in linear space. rows: (frames x points via sampleIds), columns: channels
-	Mat sampleIds(-1 * Mat::ones(frameCount, pointCount, CV_32SC1)); // row index of given point, given frame in sampledColor or -1 if invalid
-	std::vector<Mat> validSamples; // submatrices prepared for the linear system
-	validSamples.reserve(frameCount);
+	char ch = rawFrame(0).channels();
+	const Visibility &vis = visibility;
+	int entryCount = vis.frameTracks.size();
+	ExposureSystem sys;
+	sys.ch = ch;
+	sys.sampledColor = Mat(entryCount, ch, CV_32FC1); // measured brightness in linear space
+	std::vector<int32_t> sampleIds(entryCount, -1); // row index in sampledColor of each visibility entry (by frame), or -1 if invalid
+	sys.frameRows.assign(1, 0);
 	
 	// Sample the color values from the projected positions on the frames
+	// each disk average is read from summed-area tables, a few rectangles per disk, instead of visiting all its pixels
 	int32_t rowId=0;
-	int matOffset=0;
 	for (int i=0; i<frameCount; i++) {
-		Mat image = frames[i];
+		Mat image = rawFrame(i);
 		assert(image.channels() == ch);
+		std::vector<Mat> sums(ch), counts(ch);
+		for (char c=0; c<ch; c++)
+			validIntegrals(image, c, sums[c], counts[c]);
 		Mat reprojected = projectPoints(i);
-		for (int j=0; j<pointCount; j++) {
-			if (bundlesEnabled[j].count(i)) {
-				float *re = reprojected.ptr<float>(j);
-				float imageX = centerX + re[0]*width*0.5,
-				      imageY = height - centerY - re[1]*height*0.5;
-				bool valid = true;
-				// if it is enabled in this frame...:
-				float *sc = sampledColor.ptr<float>(rowId);
-				float sample;
-				for (char c=0; c<ch; c++) {
-					if ((sample = sampleImage(image, 16, imageX, imageY, c)) == -1) {
-						valid = false;
-						break;
-					}
-					sc[c] = sample;
-				}
-				if (valid) {
-					sampleIds.at<int32_t>(i, j) = rowId;
-					rowId ++; // otherwise, the data get overwritten
-				} else {
-					sampleIds.at<int32_t>(i, j) = -1;
+		// only the points enabled in this frame
+		for (int k=vis.frameStart[i]; k<vis.frameStart[i+1]; k++) {
+			float *re = reprojected.ptr<float>(vis.frameTracks[k]);
+			float imageX = centerX + re[0]*width*0.5,
+			      imageY = height - centerY - re[1]*height*0.5;
+			bool valid = true;
+			float *sc = sys.sampledColor.ptr<float>(rowId);
+			float sample;
+			for (char c=0; c<ch; c++) {
+				if ((sample = sampleDisk(sums[c], counts[c], 16, imageX, imageY)) == -1) {
+					valid = false;
+					break;
 				}
-			} else {
-				sampleIds.at<int32_t>(i, j) = -1;
+				sc[c] = sample;
+			}
+			if (valid) {
+				sampleIds[k] = rowId;
+				sys.sampleTrack.push_back(vis.frameTracks[k]);
+				rowId ++; // otherwise, the data get overwritten
 			}
 		}
-		if (rowId-matOffset < ch) {
+		if (rowId - sys.frameRows.back() < ch) {
 			// TODO: retry taking all values into account
 			assert(false);
 		}
-		validSamples.push_back(sampledColor.rowRange(matOffset, rowId));
-		matOffset = rowId;
+		sys.frameRows.push_back(rowId);
 	}
-	sampledColor.resize(rowId);
+	sys.sampledColor.resize(rowId);
 
-	// calculate the current brightness of the points, for normalization
-	double sumBrightness = 0;
+	// samples of each point, in the order of frames
+	sys.trackStart.assign(1, 0);
 	for (int j=0; j<pointCount; j++) {
-		float sum = 0.;
-		int weightSum = 0;
-		for (int i=0; i<frameCount; i++) {
-			int32_t rowId = sampleIds.at<int32_t>(i, j);
-			if (rowId == -1)
+		for (int t=vis.trackStart[j]; t<vis.trackStart[j+1]; t++) {
+			int32_t sampleRow = sampleIds[vis.trackEntries[t]];
+			if (sampleRow == -1)
 				continue;
-			float *sc = sampledColor.ptr<float>(rowId);
-			for (char c=0; c < ch; c++)
-				sumBrightness += sc[c];
+			sys.trackRows.push_back(sampleRow);
+			sys.trackFrames.push_back(vis.trackFrames[t]);
 		}
+		sys.trackStart.push_back(sys.trackRows.size());
+	}
+
+	// the normal matrix of each frame depends only on the samples, so it is factored just once
+	sys.normalInverses.resize(frameCount);
+	for (int i=0; i<frameCount; i++) {
+		Mat samples;
+		sys.sampledColor.rowRange(sys.frameRows[i], sys.frameRows[i+1]).convertTo(samples, CV_64FC1);
+		cv::invert(samples.t() * samples, sys.normalInverses[i], cv::DECOMP_SVD);
+	}
+
+	// calculate the current brightness of the points, for normalization
+	// every valid sample is a single row of sampledColor
+	double sumBrightness = 0;
+	for (int r=0; r<sys.sampledColor.rows; r++) {
+		float *sc = sys.sampledColor.ptr<float>(r);
+		for (char c=0; c < ch; c++)
+			sumBrightness += sc[c];
 	}
 	sumBrightness *= 1./ch;
 	
 	// Estimate the exposure
 	// assuming: sampledColor[frame][point] . exposure[frame] (should)= pointBrightness[point]
-	Mat exposure(1./ch * Mat::ones(ch, frameCount, CV_32FC1)), pointBrightness(Mat::ones(pointCount, 1, CV_32FC1));
-	int iteration = 0;
-	double error;
-	for (int iteration=0; iteration<100; iteration++) {
-		error = 0;
-		double currentSumBrightness = 0;
-		// imagine that exposure is correct
-		for (int j=0; j<pointCount; j++) {
-			float sum = 0.;
-			int weightSum = 0;
-			for (int i=0; i<frameCount; i++) {
-				int32_t rowId = sampleIds.at<int32_t>(i, j);
-				if (rowId == -1)
-					continue;
-				weightSum += 1;
-				float *sc = sampledColor.ptr<float>(rowId);
-				for (char c=0; c < ch; c++) {
-					sum += sc[c] * exposure.at<float>(c, i);
-				}
-			}
-			currentSumBrightness += sum;
-			//pointColor[j] = avg(sampledColor[i, j] * exposure[i] over all i)
-			float *pb = pointBrightness.ptr<float>(0);
-			if (weightSum > 0)
-				pointBrightness.at<float>(j) = sum / weightSum;
-			else
-				pointBrightness.at<float>(j) = 0.;
-		}
+	sys.exposure = 1./ch * Mat::ones(ch, frameCount, CV_32FC1);
+	sys.brightness.assign(pointCount, 1.);
+	sys.pointSums.resize(pointCount);
+	sys.frameChanges.resize(frameCount);
+	sys.frameNorms.resize(frameCount);
+	sys.frameErrors.resize(frameCount);
+	// strongly overrelax
+	sys.omega = 0.4;
+	// stop when the exposure changes by less than this, relative to its magnitude
+	const double tolerance = 1e-5;
+	int iteration;
+	double error, change;
+	for (iteration=0; iteration<100; iteration++) {
+		workers->parallelFor(pointCount, 1024, solvePoints, &sys);
 		
 		// normalize brightness to original scale
-		pointBrightness *= sumBrightness / currentSumBrightness;
+		double currentSumBrightness = 0;
+		for (int j=0; j<pointCount; j++)
+			currentSumBrightness += sys.pointSums[j];
+		float scale = sumBrightness / currentSumBrightness;
+		for (int j=0; j<pointCount; j++)
+			sys.brightness[j] *= scale;
 		
-		//imagine that point colors are correct
+		workers->parallelFor(frameCount, 16, solveFrames, &sys);
+		double changeSum = 0., normSum = 0.;
+		error = 0.;
 		for (int i=0; i<frameCount; i++) {
-			Mat oldExposure;
-			exposure.col(i).copyTo(oldExposure);
-			//exposure[i][*] = validSamples[i]^-1 . pointBrightness[*]
-			Mat validPointBrightness(0, 1, CV_32FC1);
-			for (int j=0; j<pointCount; j++) {
-				if (sampleIds.at<int32_t>(i, j) >= 0)
-					validPointBrightness.push_back(pointBrightness.at<float>(j));
-			}
-			assert(validSamples[i].rows == validPointBrightness.rows);
-			// strongly overrelax
-			float omega = 0.4;
-			exposure.col(i) = validSamples[i].inv(cv::DECOMP_SVD) * validPointBrightness * (1+omega) - oldExposure * omega;
-			error += cv::norm(validSamples[i]*exposure.col(i) - validPointBrightness) / validPointBrightness.rows;
+			changeSum += sys.frameChanges[i];
+			normSum += sys.frameNorms[i];
+			error += sys.frameErrors[i];
 		}
-		if (error/frameCount < 0.1)
+		change = sqrt(changeSum / normSum);
+		if (change < tolerance)
 			break;
 	}
+	exposure = sys.exposure;
+	if (verbosity >= 2)
+		printf(" Exposure converged in %i iterations, relative change %g, error %g per frame\n", iteration, change, error/frameCount);
 
 	// save the exposure to a text file, along with some statistical measures
 	if (verbosity >= 3) {
@@ -394,13 +682,10 @@ void Configuration::estimateExposure()
 		for (int i=0; i<frameCount; i++) {
 			float stddev = 0.;
 			int weightSum = 0;
-			for (int j=0; j<pointCount; j++) {
-				int32_t rowId = sampleIds.at<int32_t>(i, j);
-				if (rowId == -1)
-					continue;
-				float *sc = sampledColor.ptr<float>(rowId);
+			for (int r=sys.frameRows[i]; r<sys.frameRows[i+1]; r++) {
+				float *sc = sys.sampledColor.ptr<float>(r);
 				for (char c=0; c<ch; c++) {
-					float difference = sc[c] - exposure.at<float>(c,i) * pointBrightness.at<float>(j);
+					float difference = sc[c] - exposure.at<float>(c,i) * sys.brightness[sys.sampleTrack[r]];
 					stddev += (difference * difference);
 					weightSum += 1;
 				}
@@ -410,20 +695,25 @@ void Configuration::estimateExposure()
 		}
 		fclose(exlog);
 	}
-	
-	// Normalize the brightness of the actual frames
-	for (int i=0; i<frameCount; i++) {
-		std::vector<Mat> channels;
-		cv::split(frames[i], channels);
-		frames[i] = Mat::zeros(frames[i].rows, frames[i].cols, CV_8UC1);
-		for (char c=0; c<ch; c++) {
-			frames[i] += channels[c] * exposure.at<float>(c, i);
-		}
-	}
+}
+
+// the frame as read from the clip, before conversion to grayscale
+// expects either all the frames to be cached, or the reader to be open
+Mat Configuration::rawFrame(int frameNo)
+{
+	if (frameCacheSize == 0)
+		return frames[frameNo];
+	else
+		return reader->read(frameNo);
 }
 
 Configuration::~Configuration()
 {
+	delete pyramids;
+	delete workers;
+	delete frameCache;
+	delete reader;
+	delete scene;
 }
 
 Mat Configuration::reconstructedPoints()
@@ -433,7 +723,23 @@ Mat Configuration::reconstructedPoints()
 
 const Mat Configuration::frame(int frameNo) const
 {
-	return frames[frameNo];
+	if (frameCache)
+		return frameCache->get(frameNo);
+	else
+		return frames[frameNo];
+}
+
+// the float pyramid of the given frame, built when it is first needed
+const FramePyramid Configuration::pyramid(int frameNo) const
+{
+	return pyramids->get(frameNo, frame(frameNo));
+}
+
+// let the frame cache decode the given frames in advance, in this order
+void Configuration::prefetchFrames(const std::vector<int> &frameNos)
+{
+	if (frameCache)
+		frameCache->prefetch(frameNos);
 }
 
 const Mat Configuration::camera(int frameNo) const
@@ -446,6 +752,21 @@ const std::vector<Mat> Configuration::allCameras() const
 	return vector<Mat> (cameras);
 }
 
+const CameraTable &Configuration::cameraTable() const
+{
+	return table;
+}
+
+const CovisibilityGraph &Configuration::covisibility() const
+{
+	return graph;
+}
+
+WorkerPool &Configuration::workerPool() const
+{
+	return *workers;
+}
+
 const float Configuration::near(int frameNo)
 {
 	return nearVals[frameNo];
@@ -458,5 +779,5 @@ const float Configuration::far(int frameNo)
 
 const int Configuration::frameCount()
 {
-	return frames.size();
+	return cameras.size();
 }
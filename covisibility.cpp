@@ -0,0 +1,196 @@
+// covisibility.cpp: which cameras see the same tracks, and how far apart they are
+// built once per clip from the track visibility and cached in a file, because it only changes with the clip
+
+#include "recon.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+// cameras sharing fewer tracks are not neighbours
+const int minSharedTracks = 2;
+
+// the cache file starts with this header, followed by start, neighbors, shared and baseline, as raw 32-bit values
+const char covisibilityMagic[8] = {'R','E','C','O','N','C','V','G'};
+const int32_t covisibilityVersion = 3; // 2 had no shared and baseline
+typedef struct {
+	char magic[8];
+	int32_t version, frameCount, edgeCount, minShared;
+	uint64_t checksum; // of the visibility and the camera centers the graph was built from
+} CovisibilityHeader;
+
+// 64-bit FNV-1a hash of the given bytes, continuing from hash
+static uint64_t fnv(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char*)data;
+	for (size_t i=0; i<size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+// the whole vector, whose size is already known
+template <class T>
+static bool writeArray(FILE *file, const std::vector<T> &vec)
+{
+	return vec.empty() || fwrite(&vec[0], sizeof(T), vec.size(), file) == vec.size();
+}
+
+template <class T>
+static bool readArray(FILE *file, std::vector<T> &vec)
+{
+	return vec.empty() || fread(&vec[0], sizeof(T), vec.size(), file) == vec.size();
+}
+
+template <class T>
+static uint64_t fnvArray(uint64_t hash, const std::vector<T> &vec)
+{
+	return vec.empty() ? hash : fnv(hash, &vec[0], vec.size() * sizeof(T));
+}
+
+CovisibilityGraph::CovisibilityGraph()
+{
+	frameCount = 0;
+	start.assign(1, 0);
+}
+
+// data shared by the threads building the rows of the graph
+typedef struct {
+	const Visibility *visibility;
+	const std::vector<float> *centers; // x, y, z of each camera
+	std::vector< std::vector<int> > rowNeighbors;
+	std::vector< std::vector<float> > rowShared, rowBaseline;
+} CovisibilityBuild;
+
+// count the tracks each camera in the range shares with every other one; each row is built independently, so the graph is symmetric
+static void buildRows(int begin, int end, void *arg)
+{
+	CovisibilityBuild *build = (CovisibilityBuild*)arg;
+	const Visibility &vis = *build->visibility;
+	const std::vector<float> &centers = *build->centers;
+	std::vector<int> counts(vis.frameCount, 0), touched;
+	for (int i=begin; i<end; i++) {
+		touched.clear();
+		for (int k=vis.frameStart[i]; k<vis.frameStart[i+1]; k++) {
+			int track = vis.frameTracks[k];
+			for (int t=vis.trackStart[track]; t<vis.trackStart[track+1]; t++) {
+				int j = vis.trackFrames[t];
+				if (j != i && counts[j]++ == 0)
+					touched.push_back(j);
+			}
+		}
+		std::sort(touched.begin(), touched.end());
+		for (int n=0; n<touched.size(); n++) {
+			int j = touched[n];
+			if (counts[j] >= minSharedTracks) {
+				build->rowNeighbors[i].push_back(j);
+				build->rowShared[i].push_back(counts[j]);
+				float dx = centers[3*i] - centers[3*j], dy = centers[3*i+1] - centers[3*j+1], dz = centers[3*i+2] - centers[3*j+2];
+				build->rowBaseline[i].push_back(sqrt(dx*dx + dy*dy + dz*dz));
+			}
+			counts[j] = 0;
+		}
+	}
+}
+
+// read the graph if the file was written from exactly the same data
+bool CovisibilityGraph::load(const char *fileName, uint64_t checksum)
+{
+	FILE *file = fopen(fileName, "rb");
+	if (!file)
+		return false;
+	CovisibilityHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, covisibilityMagic, sizeof(covisibilityMagic)) == 0 &&
+	          header.version == covisibilityVersion && header.minShared == minSharedTracks && header.checksum == checksum && header.frameCount >= 0 && header.edgeCount >= 0;
+	if (ok) {
+		frameCount = header.frameCount;
+		start.resize(frameCount + 1);
+		neighbors.resize(header.edgeCount);
+		shared.resize(header.edgeCount);
+		baseline.resize(header.edgeCount);
+		ok = readArray(file, start) && readArray(file, neighbors) && readArray(file, shared) && readArray(file, baseline) &&
+		     start[frameCount] == header.edgeCount;
+	}
+	fclose(file);
+	return ok;
+}
+
+void CovisibilityGraph::save(const char *fileName, uint64_t checksum) const
+{
+	FILE *file = fopen(fileName, "wb");
+	if (!file)
+		return;
+	CovisibilityHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, covisibilityMagic, sizeof(covisibilityMagic));
+	header.version = covisibilityVersion;
+	header.frameCount = frameCount;
+	header.edgeCount = neighbors.size();
+	header.minShared = minSharedTracks;
+	header.checksum = checksum;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+	          writeArray(file, start) && writeArray(file, neighbors) && writeArray(file, shared) && writeArray(file, baseline);
+	ok = (fclose(file) == 0) && ok;
+	if (!ok)
+		remove(fileName);
+}
+
+// get the graph from the given cache file, or build it and save it there; returns true if it was loaded
+bool CovisibilityGraph::build(const Visibility &visibility, const CameraTable &cameras, WorkerPool &workers, const char *cacheFile)
+{
+	TraceScope trace("buildCovisibility");
+	int count = visibility.frameCount;
+	std::vector<float> centers(3*count);
+	for (int i=0; i<count; i++) {
+		const Mat center = cameras.center(i);
+		for (int k=0; k<3; k++)
+			centers[3*i + k] = center.at<float>(k) / center.at<float>(3);
+	}
+	uint64_t checksum = 0xCBF29CE484222325ULL;
+	checksum = fnv(checksum, &count, sizeof(count));
+	checksum = fnvArray(checksum, visibility.frameStart);
+	checksum = fnvArray(checksum, visibility.frameTracks);
+	checksum = fnvArray(checksum, centers);
+	if (cacheFile && load(cacheFile, checksum))
+		return true;
+
+	CovisibilityBuild build;
+	build.visibility = &visibility;
+	build.centers = &centers;
+	build.rowNeighbors.resize(count);
+	build.rowShared.resize(count);
+	build.rowBaseline.resize(count);
+	workers.parallelFor(count, 16, buildRows, &build);
+
+	frameCount = count;
+	start.assign(count + 1, 0);
+	for (int i=0; i<count; i++)
+		start[i+1] = start[i] + build.rowNeighbors[i].size();
+	neighbors.clear();
+	shared.clear();
+	baseline.clear();
+	for (int i=0; i<count; i++) {
+		neighbors.insert(neighbors.end(), build.rowNeighbors[i].begin(), build.rowNeighbors[i].end());
+		shared.insert(shared.end(), build.rowShared[i].begin(), build.rowShared[i].end());
+		baseline.insert(baseline.end(), build.rowBaseline[i].begin(), build.rowBaseline[i].end());
+	}
+	if (cacheFile)
+		save(cacheFile, checksum);
+	return false;
+}
+
+bool CovisibilityGraph::adjacent(int i, int j) const
+{
+	return edge(i, j) >= 0;
+}
+
+// position of the edge (i, j) in neighbors, shared and baseline, or -1 if there is none
+int CovisibilityGraph::edge(int i, int j) const
+{
+	if (i < 0 || i >= frameCount)
+		return -1;
+	std::vector<int32_t>::const_iterator first = neighbors.begin() + start[i], last = neighbors.begin() + start[i+1];
+	std::vector<int32_t>::const_iterator it = std::lower_bound(first, last, j);
+	return (it != last && *it == j) ? it - neighbors.begin() : -1;
+}
@@ -0,0 +1,172 @@
+// debug_sink.cpp: writing of the debugging output in background threads
+// so that saving images and meshes does not slow down the computation being diagnosed
+
+#include "recon.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// a single file waiting to be written
+typedef struct {
+	enum Kind {image, mesh, quit};
+	int kind;
+	std::string fileName;
+	Mat data, faces; // image, or vertices and faces of a mesh
+	bool normalize;
+} DebugItem;
+
+// position of a single image in the raw container
+typedef struct {
+	std::string name;
+	int32_t rows, cols, channels;
+	int64_t offset;
+} ContainerEntry;
+
+// the container starts with this magic string and a version number, and ends with the offset of the index and the magic string
+const char containerMagic[8] = {'R','E','C','O','N','D','B','G'};
+const int32_t containerVersion = 1;
+
+static BoundedQueue<DebugItem> *debugQueue = NULL;
+static ThreadGroup debugWriters;
+static int debugWriterCount = 0;
+static FILE *container = NULL;
+static std::vector<ContainerEntry> containerIndex;
+static Monitor containerLock; // guards container and containerIndex
+
+// append an image to the container as a tile of raw floats, row by row
+static void writeContainerImage(const std::string &name, const Mat image)
+{
+	Mat data;
+	image.convertTo(data, CV_32F);
+	ContainerEntry entry;
+	entry.name = name;
+	entry.rows = data.rows;
+	entry.cols = data.cols;
+	entry.channels = data.channels();
+
+	MonitorLock lock(containerLock);
+	entry.offset = ftello(container);
+	size_t rowSize = data.cols * data.elemSize();
+	for (int i=0; i<data.rows; i++)
+		fwrite(data.ptr<uchar>(i), 1, rowSize, container);
+	containerIndex.push_back(entry);
+}
+
+// write the index: entry count, then (name length, name, rows, cols, channels, offset) for each entry
+static void finishContainer()
+{
+	int64_t indexOffset = ftello(container);
+	int32_t count = containerIndex.size();
+	fwrite(&count, sizeof(count), 1, container);
+	for (int i=0; i<count; i++) {
+		const ContainerEntry &entry = containerIndex[i];
+		int32_t nameLength = entry.name.size();
+		fwrite(&nameLength, sizeof(nameLength), 1, container);
+		fwrite(entry.name.data(), 1, nameLength, container);
+		fwrite(&entry.rows, sizeof(entry.rows), 1, container);
+		fwrite(&entry.cols, sizeof(entry.cols), 1, container);
+		fwrite(&entry.channels, sizeof(entry.channels), 1, container);
+		fwrite(&entry.offset, sizeof(entry.offset), 1, container);
+	}
+	fwrite(&indexOffset, sizeof(indexOffset), 1, container);
+	fwrite(containerMagic, 1, sizeof(containerMagic), container);
+	fclose(container);
+	container = NULL;
+	containerIndex.clear();
+}
+
+// body of a writer thread: encode and write items until told to quit
+static void debugWriter(int threadNo, void *arg)
+{
+	while (1) {
+		DebugItem item = debugQueue->pop();
+		if (item.kind == DebugItem::quit)
+			break;
+		TraceScope trace("debugWrite");
+		if (item.kind == DebugItem::mesh)
+			writeMesh(Mesh(item.data, item.faces), item.fileName.c_str());
+		else if (container)
+			writeContainerImage(item.fileName, item.data);
+		else
+			writeImage(item.data, item.fileName.c_str(), item.normalize);
+	}
+}
+
+// start the given number of writer threads
+// if containerFile is set, images are stored there as raw floats instead of separate files
+void startDebugSink(int threadCount, const char *containerFile)
+{
+	if (containerFile) {
+		container = fopen(containerFile, "wb");
+		if (!container) {
+			fprintf(stderr, "Cannot write debug container %s, saving separate images instead.\n", containerFile);
+		} else {
+			fwrite(containerMagic, 1, sizeof(containerMagic), container);
+			fwrite(&containerVersion, sizeof(containerVersion), 1, container);
+		}
+	}
+	debugWriterCount = threadCount;
+	// a few items per thread are enough to keep the writers busy without holding many images in memory
+	debugQueue = new BoundedQueue<DebugItem>(4 * threadCount);
+	debugWriters.start(threadCount, debugWriter, NULL);
+	atexit(finishDebugSink);
+}
+
+// wait until everything queued is written and stop the writer threads
+void finishDebugSink()
+{
+	if (!debugQueue)
+		return;
+	DebugItem quit;
+	quit.kind = DebugItem::quit;
+	for (int i=0; i<debugWriterCount; i++)
+		debugQueue->push(quit);
+	debugWriters.join();
+	delete debugQueue;
+	debugQueue = NULL;
+	if (container)
+		finishContainer();
+}
+
+// hand an image over to the writer threads; returns false if they are not running
+bool queueDebugImage(const Mat image, const char *fileName, bool normalize)
+{
+	if (!debugQueue)
+		return false;
+	DebugItem item;
+	item.kind = DebugItem::image;
+	item.fileName = fileName;
+	// the caller may modify the image as soon as we return
+	item.data = image.clone();
+	item.normalize = normalize;
+	debugQueue->push(item);
+	return true;
+}
+
+// hand a mesh over to the writer threads; returns false if they are not running
+bool queueDebugMesh(const Mesh mesh, const char *fileName)
+{
+	if (!debugQueue)
+		return false;
+	DebugItem item;
+	item.kind = DebugItem::mesh;
+	item.fileName = fileName;
+	item.data = mesh.vertices.clone();
+	item.faces = mesh.faces.clone();
+	debugQueue->push(item);
+	return true;
+}
+
+// the positions are copied only if the sink is running, and only once
+bool queueDebugPoints(const PointStore &points, const char *fileName)
+{
+	if (!debugQueue)
+		return false;
+	DebugItem item;
+	item.kind = DebugItem::mesh;
+	item.fileName = fileName;
+	item.data = points.points();
+	debugQueue->push(item);
+	return true;
+}
@@ -17,8 +17,12 @@
 #endif
 
 #ifndef TEST_BUILD
-Mat calculateFlow(Mat prev, Mat next, bool use_farneback)
+// the pyramid is only needed by the comparison, both algorithms work on the original images
+// next gets no pyramid of its own, only its remapped version is compared
+Mat calculateFlow(const FramePyramid &prevPyramid, const Mat next, bool use_farneback)
 {
+	TraceScope trace("calculateFlow");
+	Mat prev = prevPyramid.image;
 	Mat flow;
 	if (use_farneback) {
 		// Calculate flow using Farnebäck's algorithm and some parameters that seem to work the best
@@ -41,7 +45,7 @@ Mat calculateFlow(Mat prev, Mat next, bool use_farneback)
 		cvReleaseMat(&vely);
 	}
 	// estimate the variance in each pixel
-	Mat variance = compare(prev, flowRemap(flow, next));
+	Mat variance = compare(prevPyramid, FramePyramid(flowRemap(flow, next)));
 	
 	// combine all the values into a single matrix
 	Mat mixInput[] = {flow, variance};
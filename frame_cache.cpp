@@ -0,0 +1,317 @@
+// frame_cache.cpp: decoding the frames of the clip on demand, keeping the recently used ones in memory
+
+#include "recon.hpp"
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <dirent.h> // needed for opendir(char*)
+#include <sys/stat.h> // needed for stat(char*)
+#include <strings.h> // needed for strcasecmp(char*, char*)
+
+// convert a decoded frame to the grayscale image used by the tracking
+// if exposure is not empty, its frameNo-th column weights the channels so that the brightness is normalized
+Mat normalizeFrame(const Mat raw, const Mat exposure, int frameNo)
+{
+	if (exposure.empty()) {
+		Mat gray;
+		cv::cvtColor(raw, gray, CV_BGR2GRAY);
+		return gray;
+	}
+	std::vector<Mat> channels;
+	cv::split(raw, channels);
+	Mat result = Mat::zeros(raw.rows, raw.cols, CV_8UC1);
+	for (char c=0; c<channels.size(); c++) {
+		result += channels[c] * exposure.at<float>(c, frameNo);
+	}
+	return result;
+}
+
+// check if the file name ends with one of the image formats supported by OpenCV
+static bool isImageFile(const char *fileName)
+{
+	static const char *extensions[] = {".png", ".jpg", ".jpeg", ".tif", ".tiff", ".bmp", ".exr", ".ppm", ".pgm"};
+	const char *dot = strrchr(fileName, '.');
+	if (!dot)
+		return false;
+	for (int i=0; i<sizeof(extensions)/sizeof(extensions[0]); i++) {
+		if (strcasecmp(dot, extensions[i]) == 0)
+			return true;
+	}
+	return false;
+}
+
+static bool fileExists(const std::string &fileName)
+{
+	struct stat info;
+	return stat(fileName.c_str(), &info) == 0 && S_ISREG(info.st_mode);
+}
+
+// the path may be a video file, a directory of images sorted by name, or a printf pattern such as "render/%04d.png"
+// a pattern is numbered from 1, like the frames in the YAML file, or from 0 if there is no image number 1
+FrameReader::FrameReader(const std::string &ipath, int iwidth, int iheight):path(ipath)
+{
+	width = iwidth;
+	height = iheight;
+	position = 0;
+	clip = NULL;
+	sourceWidth = sourceHeight = 0;
+	struct stat info;
+	if (path.find('%') != std::string::npos) {
+		char fileName[1024];
+		int first = 1;
+		snprintf(fileName, sizeof(fileName), path.c_str(), first);
+		if (!fileExists(fileName))
+			first = 0;
+		for (int i=first; ; i++) {
+			snprintf(fileName, sizeof(fileName), path.c_str(), i);
+			if (!fileExists(fileName))
+				break;
+			files.push_back(fileName);
+		}
+	} else if (stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+		DIR *dir = opendir(path.c_str());
+		for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+			if (isImageFile(entry->d_name))
+				files.push_back(path + '/' + entry->d_name);
+		}
+		closedir(dir);
+		std::sort(files.begin(), files.end());
+	} else {
+		clip = new cv::VideoCapture(path);
+	}
+}
+
+FrameReader::~FrameReader()
+{
+	delete clip;
+}
+
+bool FrameReader::isOpened()
+{
+	return clip ? clip->isOpened() : !files.empty();
+}
+
+// number of frames in the whole clip, including the ones not tracked
+int FrameReader::clipLength()
+{
+	return clip ? clip->get(CV_CAP_PROP_FRAME_COUNT) : files.size();
+}
+
+// choose the frames of the clip that get tracked, after skipping some of them or selecting keyframes
+void FrameReader::setFrames(const std::vector<int> &iclipFrames)
+{
+	clipFrames = iclipFrames;
+}
+
+// remap each frame through the given table instead of just scaling it (see undistortionMaps)
+// the table expects frames of the source size, other sizes get scaled to it first
+void FrameReader::setUndistortion(const Mat imap1, const Mat imap2, int isourceWidth, int isourceHeight)
+{
+	map1 = imap1;
+	map2 = imap2;
+	sourceWidth = isourceWidth;
+	sourceHeight = isourceHeight;
+}
+
+// decode the given tracked frame, scaled to the size of the reconstruction (and undistorted, if set)
+// images of a sequence may be read by several threads at once
+// a video is read by a single thread at a time: reading the frames in order is fast, otherwise the clip has to seek
+Mat FrameReader::read(int frameNo)
+{
+	TraceScope trace("decodeFrame");
+	int target = clipFrames[frameNo];
+	Mat frame, result;
+	if (clip) {
+		MonitorLock lock(monitor);
+		if (target < position || target > position + maxGrabs) {
+			clip->set(CV_CAP_PROP_POS_FRAMES, target);
+		} else {
+			// skipped frames are only grabbed, without converting them to an image
+			for (; position < target; position++)
+				clip->grab();
+		}
+		clip->read(frame);
+		position = target + 1;
+	} else if (target < files.size()) {
+		frame = cv::imread(files[target]);
+	}
+	if (frame.empty()) {
+		fprintf(stderr, "Cannot decode frame %i of the clip, exiting.\n", target);
+		exit(1);
+	}
+	if (!map1.empty()) {
+		if (frame.rows != sourceHeight || frame.cols != sourceWidth)
+			cv::resize(frame, frame, cv::Size(sourceWidth, sourceHeight), 0, 0, CV_INTER_LINEAR);
+		cv::remap(frame, result, map1, map2, CV_INTER_LINEAR);
+	} else if (frame.rows != height || frame.cols != width)
+		cv::resize(frame, result, cv::Size(width, height), 0, 0, CV_INTER_AREA);
+	else
+		frame.copyTo(result);
+	return result;
+}
+
+// a contiguous range of frames decoded by a single thread
+typedef struct {
+	FrameReader *reader;
+	std::vector<Mat> *frames;
+	int begin, end;
+} FrameSegment;
+
+static void segmentWorker(int threadNo, void *arg)
+{
+	FrameSegment &segment = ((FrameSegment*)arg)[threadNo];
+	for (int fi = segment.begin; fi < segment.end; fi++)
+		(*segment.frames)[fi] = segment.reader->read(fi);
+}
+
+// decode frames.size() first tracked frames using the given number of threads, each reading a contiguous segment
+// each segment of a video gets its own reader, so that the threads decode independently
+void FrameReader::readAll(std::vector<Mat> &frames, int threadCount)
+{
+	int count = frames.size();
+	threadCount = IMAX(IMIN(threadCount, count), 1);
+	std::vector<FrameSegment> segments(threadCount);
+	for (int i=0; i<threadCount; i++) {
+		if (clip) {
+			// the table is shared, not copied
+			segments[i].reader = new FrameReader(path, width, height);
+			segments[i].reader->setFrames(clipFrames);
+			segments[i].reader->setUndistortion(map1, map2, sourceWidth, sourceHeight);
+		} else {
+			segments[i].reader = this;
+		}
+		segments[i].frames = &frames;
+		segments[i].begin = (long)count * i / threadCount;
+		segments[i].end = (long)count * (i+1) / threadCount;
+	}
+	ThreadGroup decoders;
+	decoders.start(threadCount, segmentWorker, &segments[0]);
+	decoders.join();
+	for (int i=0; i<threadCount; i++) {
+		if (segments[i].reader != this)
+			delete segments[i].reader;
+	}
+}
+
+FrameCache::FrameCache(FrameReader *ireader, const Mat iexposure, size_t ibudget):exposure(iexposure)
+{
+	reader = ireader;
+	budget = ibudget;
+	usedBytes = prefetchedBytes = 0;
+	prefetchIndex = 0;
+	quitting = false;
+	prefetcher.start(1, FrameCache::prefetchWorker, this);
+}
+
+FrameCache::~FrameCache()
+{
+	{
+		MonitorLock lock(monitor);
+		quitting = true;
+		monitor.broadcast();
+	}
+	prefetcher.join();
+}
+
+// decode a frame; expects the monitor to be locked and returns with it locked again
+// the entry is marked as being decoded, so that other threads wait for it instead of decoding it twice
+Mat FrameCache::decode(int frameNo, bool prefetched)
+{
+	Entry &entry = entries[frameNo];
+	entry.ready = false;
+	entry.prefetched = prefetched;
+	lru.push_front(frameNo);
+	entry.position = lru.begin();
+	monitor.unlock();
+
+	Mat image = normalizeFrame(reader->read(frameNo), exposure, frameNo);
+
+	monitor.lock();
+	Entry &decoded = entries[frameNo];
+	decoded.image = image;
+	decoded.ready = true;
+	size_t size = image.total() * image.elemSize();
+	usedBytes += size;
+	if (decoded.prefetched)
+		prefetchedBytes += size;
+	evict();
+	monitor.broadcast();
+	return image;
+}
+
+// drop the least recently used frames until the cache fits into its budget
+// the most recent frame is always kept, whatever its size
+void FrameCache::evict()
+{
+	std::list<int>::iterator it = lru.end();
+	while (usedBytes > budget && it != lru.begin()) {
+		it--;
+		if (it == lru.begin())
+			break;
+		Entry &entry = entries[*it];
+		if (!entry.ready)
+			continue;
+		size_t size = entry.image.total() * entry.image.elemSize();
+		usedBytes -= size;
+		if (entry.prefetched)
+			prefetchedBytes -= size;
+		entries.erase(*it);
+		it = lru.erase(it);
+	}
+}
+
+// return the given frame, decoding it if necessary
+Mat FrameCache::get(int frameNo)
+{
+	MonitorLock lock(monitor);
+	while (1) {
+		std::map<int, Entry>::iterator found = entries.find(frameNo);
+		if (found == entries.end())
+			break;
+		Entry &entry = found->second;
+		if (!entry.ready) {
+			// another thread is decoding this frame right now
+			monitor.wait();
+			continue;
+		}
+		// mark it as the most recently used one
+		lru.splice(lru.begin(), lru, entry.position);
+		if (entry.prefetched) {
+			prefetchedBytes -= entry.image.total() * entry.image.elemSize();
+			entry.prefetched = false;
+			monitor.broadcast();
+		}
+		return entry.image;
+	}
+	return decode(frameNo, false);
+}
+
+// decode the given frames in background, in this order; replaces the previous list
+void FrameCache::prefetch(const std::vector<int> &frameNos)
+{
+	MonitorLock lock(monitor);
+	prefetchList = frameNos;
+	prefetchIndex = 0;
+	monitor.broadcast();
+}
+
+// body of the prefetching thread
+// prefetched frames that have not been used yet may take at most half of the budget, so that they do not evict each other
+void FrameCache::prefetchWorker(int threadNo, void *arg)
+{
+	FrameCache *cache = (FrameCache*)arg;
+	MonitorLock lock(cache->monitor);
+	while (!cache->quitting) {
+		if (cache->prefetchIndex >= cache->prefetchList.size() || cache->prefetchedBytes * 2 >= cache->budget) {
+			cache->monitor.wait();
+			continue;
+		}
+		int frameNo = cache->prefetchList[cache->prefetchIndex++];
+		if (cache->entries.count(frameNo))
+			continue;
+		cache->decode(frameNo, true);
+	}
+}
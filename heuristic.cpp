@@ -1,24 +1,223 @@
 // heuristic.cpp: a class encapsulating all the heuristic algorithms used
 
-#include <opencv2/flann/flann.hpp>
 #include "recon.hpp"
 #include <map>
+#include <algorithm>
 
-typedef cvflann::L2_Simple<float> Distance;
-typedef std::pair<int, float> Neighbor;
 const float focal = 0.5; // focal length of the camera P used for projection from faces
-
-// Structure describing a camera selected by the heuristic
-typedef struct {
-	int index; // actual camera index in the video sequence
-	float cosFromViewer, // cosine of this camera viewed from the given point
-	      distance; // distance of the point to the camera, projected along the camera axis
-	float viewX, viewY; // coordinates as viewed from the given point's camera
-} CameraLabel;
+const float normalAgreement = 0.9; // with --incremental, a shot is reused only if the surface normal turned less than this cosine
+const int nominalShots = 200; // the camera selection takes this many shots without --coverage, and its pair weights are scaled to it
+const int coverageBins = 64; // approximate number of bins of the coverage map
+const int minSideTracks = 8; // a side camera sharing fewer tracks with the main camera is a weak candidate
+const float minSideBaseline = 0.02; // or one closer to it than this fraction of the distance of the point, about a degree of parallax
 
 const CameraLabel dummyLabel = {-1, 0, 0}; // camera label if selection fails
 
-typedef std::vector< std::pair<CameraLabel, Mat> > LabelledCameras;
+// Walker's alias table: draws an index with probability proportional to its weight, in constant time
+// built in linear time; the storage is kept between builds so that rebuilding does not allocate
+class AliasTable {
+	public:
+		void build(const std::vector<float> &weights);
+		int draw(cv::RNG &random) const;
+	protected:
+		std::vector<float> probability; // of keeping the drawn column instead of taking its alias
+		std::vector<int> alias;
+		std::vector<int> small, large; // scratch space for building
+};
+
+void AliasTable::build(const std::vector<float> &weights)
+{
+	int n = weights.size();
+	probability.resize(n);
+	alias.resize(n);
+	small.clear();
+	large.clear();
+	double sum = 0;
+	for (int i=0; i<n; i++)
+		sum += weights[i];
+	// scale the weights so that their average is 1, and split them to those under and over the average
+	for (int i=0; i<n; i++) {
+		probability[i] = (sum > 0) ? weights[i] * n / sum : 1;
+		alias[i] = i;
+		if (probability[i] < 1)
+			small.push_back(i);
+		else
+			large.push_back(i);
+	}
+	// fill each small column up to 1 from a large one
+	while (!small.empty() && !large.empty()) {
+		int s = small.back(), l = large.back();
+		small.pop_back();
+		alias[s] = l;
+		probability[l] -= 1 - probability[s];
+		if (probability[l] < 1) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	// whatever remains is 1 up to rounding errors
+	for (int i=0; i<small.size(); i++)
+		probability[small[i]] = 1;
+	for (int i=0; i<large.size(); i++)
+		probability[large[i]] = 1;
+}
+
+// the column and the coin are drawn separately, a single float would leave the coin too few bits for large tables
+int AliasTable::draw(cv::RNG &random) const
+{
+	int column = random.uniform(0, (int)probability.size());
+	return ((float)random < probability[column]) ? column : alias[column];
+}
+
+const uint64_t PairWeights::emptyKey;
+
+PairWeights::PairWeights():keys(64, emptyKey), values(64, 0)
+{
+	count = 0;
+}
+
+// position of the key in the table, or of the empty slot where it belongs
+size_t PairWeights::slot(uint64_t k) const
+{
+	size_t mask = keys.size() - 1;
+	size_t i = (k * 0x9E3779B97F4A7C15ULL) >> 32 & mask;
+	while (keys[i] != k && keys[i] != emptyKey)
+		i = (i+1) & mask;
+	return i;
+}
+
+bool PairWeights::contains(int i, int j) const
+{
+	return keys[slot(key(i, j))] != emptyKey;
+}
+
+float PairWeights::get(int i, int j) const
+{
+	size_t s = slot(key(i, j));
+	return (keys[s] == emptyKey) ? 0 : values[s];
+}
+
+bool PairWeights::entry(size_t s, int &i, int &j, float &weight) const
+{
+	if (keys[s] == emptyKey)
+		return false;
+	i = (int)(uint32_t)(keys[s] >> 32);
+	j = (int)(uint32_t)keys[s];
+	weight = values[s];
+	return true;
+}
+
+float &PairWeights::operator()(int i, int j)
+{
+	uint64_t k = key(i, j);
+	size_t s = slot(k);
+	if (keys[s] == k)
+		return values[s];
+	if (2*(count+1) > keys.size()) {
+		// keep the table at most half full
+		std::vector<uint64_t> oldKeys(keys.size()*2, emptyKey);
+		std::vector<float> oldValues(values.size()*2, 0);
+		oldKeys.swap(keys);
+		oldValues.swap(values);
+		for (size_t o=0; o<oldKeys.size(); o++) {
+			if (oldKeys[o] == emptyKey)
+				continue;
+			size_t n = slot(oldKeys[o]);
+			keys[n] = oldKeys[o];
+			values[n] = oldValues[o];
+		}
+		s = slot(k);
+	}
+	keys[s] = k;
+	values[s] = 0;
+	count ++;
+	return values[s];
+}
+
+// a single key for the cell (x, y, z) of a uniform grid
+static inline uint64_t gridKey(int x, int y, int z)
+{
+	return ((uint64_t)(x & 0x1FFFFF) << 42) | ((uint64_t)(y & 0x1FFFFF) << 21) | (uint64_t)(z & 0x1FFFFF);
+}
+
+// points hashed into a uniform grid, for finding the ones near a given position
+class PointGrid {
+	public:
+		void build(const float *points, int count, float cellSize); // three coordinates per point
+		void build(const PointStore &points, float cellSize); // the dehomogenized positions, read block by block
+		void inBox(const float *low, const float *high, std::vector<int> &result) const; // the points in the cells overlapping the box
+	protected:
+		int cell(float coord) const {return (int)floor(coord / cellSize);};
+		float cellSize;
+		int pointCount;
+		std::vector< std::pair<uint64_t, int> > cells; // (cell key, point index), sorted
+};
+
+void PointGrid::build(const float *points, int count, float icellSize)
+{
+	cellSize = icellSize;
+	pointCount = count;
+	cells.resize(pointCount);
+	for (int i=0; i<pointCount; i++)
+		cells[i] = std::make_pair(gridKey(cell(points[3*i]), cell(points[3*i+1]), cell(points[3*i+2])), i);
+	std::sort(cells.begin(), cells.end());
+}
+
+void PointGrid::build(const PointStore &points, float icellSize)
+{
+	cellSize = icellSize;
+	pointCount = points.size();
+	cells.resize(pointCount);
+	for (int b=0; b<points.blockCount(); b++) {
+		const float *x = points.column(b, PointStore::posX), *y = points.column(b, PointStore::posY),
+		            *z = points.column(b, PointStore::posZ), *w = points.column(b, PointStore::posW);
+		int first = b * PointStore::blockSize;
+		for (int i=0; i<points.blockLength(b); i++)
+			cells[first + i] = std::make_pair(gridKey(cell(x[i]/w[i]), cell(y[i]/w[i]), cell(z[i]/w[i])), first + i);
+	}
+	std::sort(cells.begin(), cells.end());
+}
+
+void PointGrid::inBox(const float *low, const float *high, std::vector<int> &result) const
+{
+	result.clear();
+	int lo[3], hi[3];
+	double cellCount = 1;
+	for (int k=0; k<3; k++) {
+		lo[k] = cell(low[k]);
+		hi[k] = cell(high[k]);
+		cellCount *= hi[k] - lo[k] + 1;
+	}
+	// a box covering more cells than there are points is answered faster by all the points
+	if (cellCount > pointCount) {
+		for (int i=0; i<pointCount; i++)
+			result.push_back(i);
+		return;
+	}
+	for (int x=lo[0]; x<=hi[0]; x++) {
+		for (int y=lo[1]; y<=hi[1]; y++) {
+			for (int z=lo[2]; z<=hi[2]; z++) {
+				uint64_t k = gridKey(x, y, z);
+				std::vector< std::pair<uint64_t, int> >::const_iterator it = std::lower_bound(cells.begin(), cells.end(), std::make_pair(k, -1));
+				for (; it != cells.end() && it->first == k; it++)
+					result.push_back(it->second);
+			}
+		}
+	}
+}
+
+// scratch space of the camera selection, reused by all the shots
+typedef struct {
+	ViewerTest test;
+	LabelledCameras filtered, sides;
+	std::vector<float> weights;
+	AliasTable sampler;
+	std::vector<int> candidates; // cached shots near the current one
+	std::vector<int> order; // filtered cameras still drawn from by chooseMain; strong edges in chooseSide
+	std::vector<float> ends; // centers of the cameras to test for obstacles
+	std::vector<uchar> blocked;
+	std::vector<signed char> tested; // whether each filtered camera is unblocked, -1 if not tested yet
+} ShotScratch;
 
 Heuristic::Heuristic(Configuration *iconfig)
 {
@@ -28,7 +227,7 @@ Heuristic::Heuristic(Configuration *iconfig)
 
 // Check if the scene is detailed enough
 // simply limits the number of iterations, nothing more complicated seemed appropriate
-bool Heuristic::notHappy(const Mat points)
+bool Heuristic::notHappy(const PointStore &points)
 {
 	iteration ++;
 	return (iteration <= config->iterationCount);
@@ -39,98 +238,214 @@ inline float const pow2(float x)
 	return x * x;
 }
 
-// a function that compacts two index into a single (hash table) index
-inline unsigned const compact(unsigned short i, unsigned short j)
-{
-	return (unsigned(i) << sizeof(short)*CHAR_BIT) + unsigned(j);
-}
-
 // neighbor distance function, used in point filtering
 inline float const densityFn(float dist, float radius)
 {
 	return (1. - dist/radius);
 }
 
+// the neighbor table of the point filtering, symmetric and in compressed rows
+// the neighbors of i-th point are index[start[i], ..., start[i+1]-1], ascending, the ones before lowerEnd[i] have smaller indices than i
+typedef struct {
+	std::vector<int64_t> start, lowerEnd; // 64-bit, as large clouds have more than 2^31 neighbor entries
+	std::vector<int> index;
+	std::vector<float> weight;
+} NeighborTable;
+
+// the dehomogenized position of a stored point
+static inline void storedPosition(const PointStore &points, int i, float *out)
+{
+	float w = points.at(i, PointStore::posW);
+	for (int k=0; k<3; k++)
+		out[k] = points.at(i, PointStore::posX + k) / w;
+}
+
+// data shared by the threads searching for the neighbors of points
+typedef struct {
+	const PointGrid *grid;
+	const PointStore *points;
+	float radius; // compared to the squared distances, as the filtering always did
+	NeighborTable *table;
+	bool fill; // false when only counting
+} NeighborSearch;
+
+// find the neighbors of each point in the range within the radius
+// the first pass counts them into start[i+1], the second one (with fill set) writes them from start[i] on, in ascending order
+// the squared distance is the same in both directions, so the table is exactly symmetric
+static void searchNeighbors(int begin, int end, void *arg)
+{
+	NeighborSearch *search = (NeighborSearch*)arg;
+	NeighborTable &table = *search->table;
+	const PointStore &points = *search->points;
+	float reach = sqrt(search->radius);
+	std::vector<int> candidates;
+	for (int i=begin; i<end; i++) {
+		float p[3], q[3];
+		storedPosition(points, i, p);
+		float low[3], high[3];
+		for (int k=0; k<3; k++) {
+			low[k] = p[k] - reach;
+			high[k] = p[k] + reach;
+		}
+		search->grid->inBox(low, high, candidates);
+		if (search->fill)
+			std::sort(candidates.begin(), candidates.end());
+		int count = 0;
+		int64_t write = search->fill ? table.start[i] : 0;
+		for (int c=0; c<candidates.size(); c++) {
+			int j = candidates[c];
+			if (j == i)
+				continue;
+			storedPosition(points, j, q);
+			float distance = (p[0]-q[0])*(p[0]-q[0]) + (p[1]-q[1])*(p[1]-q[1]) + (p[2]-q[2])*(p[2]-q[2]);
+			if (distance > search->radius)
+				continue;
+			if (search->fill) {
+				if (j < i)
+					table.lowerEnd[i] = write + 1;
+				table.index[write] = j;
+				table.weight[write] = densityFn(distance, search->radius);
+				write ++;
+			}
+			count ++;
+		}
+		if (!search->fill)
+			table.start[i+1] = count;
+	}
+}
+
+// sum of x[index[k]] * weight[k] over the given entries
+// x is read at scattered places, so a vector load does not apply; four independent sums hide the latency of the reads instead
+static inline float gatherDot(const int *index, const float *weight, int count, const float *x)
+{
+	float total[4] = {0., 0., 0., 0.};
+	int k = 0;
+	for (; k+4<=count; k+=4) {
+		total[0] += x[index[k]] * weight[k];
+		total[1] += x[index[k+1]] * weight[k+1];
+		total[2] += x[index[k+2]] * weight[k+2];
+		total[3] += x[index[k+3]] * weight[k+3];
+	}
+	for (; k<count; k++)
+		total[0] += x[index[k]] * weight[k];
+	return (total[0] + total[1]) + (total[2] + total[3]);
+}
+
+// rows processed by a single thread in one step of the density iteration
+const int densityChunk = 1024;
+
+// data shared by the threads of a single step of the density iteration
+typedef struct {
+	const NeighborTable *table;
+	float *density, *score;
+	float normalizer;
+	std::vector<double> sums; // one per chunk of rows, added up in order so that the result does not depend on the threads
+} DensityStep;
+
+// score each point in the range by the density of its neighbors, weighted by their distance
+// every row only reads, so that no two threads write to the same point
+static void scoreDensity(int begin, int end, void *arg)
+{
+	DensityStep *step = (DensityStep*)arg;
+	const NeighborTable &table = *step->table;
+	double sum = 0.;
+	for (int i=begin; i<end; i++) {
+		int64_t first = table.start[i];
+		int count = table.start[i+1] - first;
+		step->score[i] = (count > 0) ? gatherDot(&table.index[first], &table.weight[first], count, step->density) : 0.;
+		sum += step->score[i];
+	}
+	step->sums[begin / densityChunk] = sum;
+}
+
+// normalize the scores in the range to new densities, summing up their squared change
+static void normalizeDensity(int begin, int end, void *arg)
+{
+	DensityStep *step = (DensityStep*)arg;
+	double change = 0.;
+	for (int i=begin; i<end; i++) {
+		// normalize using L1 norm
+		float normalizedDensity = step->score[i] * step->normalizer;
+		// apply clamping
+		if (normalizedDensity > 2.)
+			normalizedDensity = 2.;
+		// calculate the total change to stop the iteration if converged
+		change += pow2(step->density[i] - normalizedDensity);
+		step->density[i] = normalizedDensity;
+	}
+	step->sums[begin / densityChunk] = change;
+}
+
 // Filter outliers and redundant points from the given point cloud
-void Heuristic::filterPoints(Mat& points, Mat& normals)
+void Heuristic::filterPoints(PointStore &points)
 {
+	TraceScope trace("filterPoints");
 	if (config->verbosity >= 1)
 		printf("Filtering: Preparing neighbor table...\n");
-	int pointCount = points.rows;
-	Mat points3 = dehomogenize(points);
+	int pointCount = points.size();
+	WorkerPool &workers = config->workerPool();
 	
 	// guess a filtering radius
 	const float radius = alphaVals.back()/4.;
 	
 	// all distances are stored as a single 1D array, for efficiency
-	// range of neighbors corresponding to i-th point is neighbors[neighborBlocks[i], ..., neighborBlocks[i+1]-1]
-	std::vector<int> neighborBlocks(pointCount+1, 0);
-	std::vector<Neighbor> neighbors;
+	NeighborTable neighbors;
+	neighbors.start.assign(pointCount+1, 0);
+	neighbors.lowerEnd.resize(pointCount);
 	
 	// == BEGIN Prepare the neighbor table ==
-	neighbors.reserve(pointCount);
 	{
-		// FLANN search structure
-		cv::flann::GenericIndex<Distance> index = cv::flann::GenericIndex<Distance>(points3, cvflann::KDTreeIndexParams());
-		cvflann::SearchParams params;
-		// temporary arrays to extract arguments from FLANN in correct format
-		std::vector<float> distances(pointCount, 0.), point(3, 0.);
-		std::vector<int> indices(pointCount, -1);
+		// the radius bounds squared distances, so the points within sqrt(radius) are neighbors
+		// with cells of that size, all the neighbors of a point are in the 3x3x3 cells around its own
+		float cellSize = sqrt(radius);
+		PointGrid grid;
+		// the positions are read from the store directly, without a copy of the whole cloud
+		grid.build(points, (cellSize > 0) ? cellSize : 1);
+		NeighborSearch search;
+		search.grid = &grid;
+		search.points = &points;
+		search.radius = radius;
+		search.table = &neighbors;
+		search.fill = false;
+		// count the neighbors of each point, then write them to their ranges
+		workers.parallelFor(pointCount, 4096, searchNeighbors, &search);
 		for (int i=0; i<pointCount; i++) {
-			points3.row(i).copyTo(point);
-			index.radiusSearch(point, indices, distances, radius, params);
-			int writeIndex = 0;
-			neighborBlocks[i] = neighbors.size();
-			int end;
-			for (end = 0; end < indices.size() && indices[end] >= 0; end++);
-			for (int j = 0; j < end; j++) {
-				// to ensure symmetry, take only neighbors with a smaller index (because FLANN is randomized)
-				if (indices[j] < i && distances[j] <= radius)
-					neighbors.push_back(Neighbor(indices[j], densityFn(distances[j], radius)));
-				indices[j] = -1;
-			}
+			neighbors.start[i+1] += neighbors.start[i];
+			neighbors.lowerEnd[i] = neighbors.start[i];
 		}
+		neighbors.index.resize(neighbors.start[pointCount]);
+		neighbors.weight.resize(neighbors.start[pointCount]);
+		search.fill = true;
+		workers.parallelFor(pointCount, 4096, searchNeighbors, &search);
 	}
-	neighborBlocks[pointCount] = neighbors.size();
+	// each pair is counted once, as before the table became symmetric
 	if (config->verbosity >= 2)
-		printf(" Neighbors total: %lu, %5.1g per point.\n", neighbors.size(), ((float)neighbors.size())/pointCount);
+		printf(" Neighbors total: %lu, %5.1g per point.\n", neighbors.index.size()/2, ((float)neighbors.index.size())/2/pointCount);
 	// == END Prepare the neighbor table ==
 	
 	if (config->verbosity >= 1)
 		printf("Estimating local density...\n");
 	
 	// Calculate the local density using the power iteration scheme with clamping
+	// each step multiplies the densities by the (symmetric) neighbor weights, in parallel over the rows
 	std::vector<float> density(pointCount, 1.), score(pointCount, 0.);
+	DensityStep step;
+	step.table = &neighbors;
+	step.density = pointCount ? &density[0] : NULL;
+	step.score = pointCount ? &score[0] : NULL;
+	step.sums.resize((pointCount + densityChunk - 1) / densityChunk);
 	double change;
 	int densityIterationNo = 0;
 	do {
-		for (int i=0; i<pointCount; i++) {
-			score[i] = 0.;
-		}
+		workers.parallelFor(pointCount, densityChunk, scoreDensity, &step);
 		double sum = 0.;
-		for (int i=0; i<pointCount; i++) {
-			// add the density of each neighbor, weighted by its distance
-			// and add the density of the current point to the neighbor, to ensure symmetry
-			float densityTemp = 0.0;
-			for (int j = neighborBlocks[i]; j < neighborBlocks[i+1]; j++) {
-				densityTemp += density[neighbors[j].first] * neighbors[j].second;
-				score[neighbors[j].first] += density[i] * neighbors[j].second;
-				sum += (density[i] + density[neighbors[j].first]) * neighbors[j].second;
-			}
-			score[i] += densityTemp;
-		}
-		float normalizer = pointCount / sum;
+		for (int c=0; c<step.sums.size(); c++)
+			sum += step.sums[c];
+		step.normalizer = pointCount / sum;
+		workers.parallelFor(pointCount, densityChunk, normalizeDensity, &step);
 		change = 0.;
-		for (int i=0; i<pointCount; i++) {
-			// normalize using L1 norm
-			float normalizedDensity = score[i] * normalizer;
-			// apply clamping
-			if (normalizedDensity > 2.)
-				normalizedDensity = 2.;
-			// calculate the total change to stop the iteration if converged
-			change += pow2(density[i] - normalizedDensity);
-			density[i] = normalizedDensity;
-		}
+		for (int c=0; c<step.sums.size(); c++)
+			change += step.sums[c];
 		change /= pointCount;
 		densityIterationNo += 1;
 	} while (change > 1e-6 && densityIterationNo < 200);
@@ -154,25 +469,19 @@ void Heuristic::filterPoints(Mat& points, Mat& normals)
 		
 		// subtract density to get rid of close neighbors
 		double localDensity = density[ord];
-		for (int j=neighborBlocks[ord]; j<neighborBlocks[ord+1]; j++) {
-			score[neighbors[j].first] -= localDensity * neighbors[j].second;
+		// only from the neighbors with smaller indices, as the table had just those before it became symmetric
+		for (int64_t j=neighbors.start[ord]; j<neighbors.lowerEnd[ord]; j++) {
+			score[neighbors.index[j]] -= localDensity * neighbors.weight[j];
 		}
 		if (i > writeIndex)
 			order[writeIndex] = order[i];
 		writeIndex ++;
 	}
 	
-	// filter the actual entries of the matrix
+	// filter the actual entries of the point store
+	// this may be performed in place thanks to sorting the indices
 	std::sort(order.begin(), order.begin() + writeIndex);
-	for (int i=0; i<writeIndex; i++) {
-		if (order[i] > i) {
-			// these operations may be performed directly thanks to sorting the indices three lines above
-			points.row(order[i]).copyTo(points.row(i));
-			normals.row(order[i]).copyTo(normals.row(i));
-		}
-	}
-	points.resize(writeIndex);
-	normals.resize(writeIndex);
+	points.retain(order, writeIndex);
 }
 
 // calculate the area of a given triangle
@@ -190,7 +499,8 @@ float faceArea(Mat points, int ia, int ib, int ic)
 }
 
 // get a camera P for a given face, used in the camera selection heuristic
-const Mat faceCamera(const Mesh mesh, int faceIdx, float far, float focal)
+// the chosen point on the face and the face normal are stored in outCenter and outNormal
+const Mat faceCamera(const Mesh mesh, int faceIdx, float far, float focal, cv::RNG &random, float *outCenter, float *outNormal)
 {
 	const int32_t *vertIdx = mesh.faces.ptr<int32_t>(faceIdx);
 	Mat a(mesh.vertices.row(vertIdx[0])),
@@ -204,7 +514,7 @@ const Mat faceCamera(const Mesh mesh, int faceIdx, float far, float focal)
 	normal /= normalLength;
 
 	// get a uniformly random camera center across the triangle
-	float u1 = cv::randu<float>(), u2 = cv::randu<float>();
+	float u1 = (float)random, u2 = (float)random;
 	if (u1 + u2 > 1) {
 		u1 = 1-u1;
 		u2 = 1-u2;
@@ -217,6 +527,10 @@ const Mat faceCamera(const Mesh mesh, int faceIdx, float far, float focal)
 	      *ce = center.ptr<float>(0);
 	float x = n[0], y = n[1], z = n[2];
 	float xys = x*x + y*y, xy = sqrt(xys);
+	for (int k=0; k<3; k++) {
+		outCenter[k] = ce[k];
+		outNormal[k] = n[k];
+	}
 	// ...go!
 	if (xy > 0) {
 		// camera rotated aleng the face normal
@@ -246,21 +560,10 @@ const Mat faceCamera(const Mesh mesh, int faceIdx, float far, float focal)
 	return K*RT;
 }
 
-// find index i such that list[i+1, ..., end] > choice
-int bisect(std::vector<float> list, float choice)
-{
-	// no bisection, it would not make the algorithm substantially faster
-	for (int i=0; i<list.size(); i++) {
-		if (list[i] > choice)
-			return i-1;
-	}
-	return list.size();
-}
-
 // find an index in a given numberedVector
 // return -1 if index not in list
 // else return i: list[i].first == index
-int myFind(std::vector<numberedVector> list, int index)
+int myFind(const std::vector<numberedVector> &list, int index)
 {
 	for (int i=0; i<list.size(); i++) {
 		if (list[i].first == index)
@@ -272,7 +575,7 @@ int myFind(std::vector<numberedVector> list, int index)
 // find an index in a given integer vector
 // return -1 if index not in list
 // else return i: list[i] == index
-int myFind(std::vector<int> list, int index)
+int myFind(const std::vector<int> &list, int index)
 {
 	for (int i=0; i<list.size(); i++) {
 		if (list[i] == index)
@@ -281,105 +584,114 @@ int myFind(std::vector<int> list, int index)
 	return -1;
 }
 
-// filter out cameras that do not display the given point on the scene surface
-LabelledCameras filterCameras(Mat viewer, Mat depth, const std::vector<Mat> cameras)
+// filter out cameras that cannot display the given point on the scene surface
+// the camera table finds the cameras that may see the point and tests them in a batch
+// obstacles are not tested here: the selection tests only the cameras it draws, see unblocked
+// the results are stored in scratch.filtered
+void filterCameras(Mat viewer, const CameraTable &cameras, ShotScratch &scratch)
 {
-	LabelledCameras filtered;
-	// go through all cameras and check if each passes all visibility tests
-	{int i=0; for (std::vector<Mat>::const_iterator camera=cameras.begin(); camera!=cameras.end(); camera++, i++) {
-		CameraLabel label;
-		label.index = i;
-		// position of camera center projected from the face viewer matrix P
-		Mat cameraFromViewer = viewer * extractCameraCenter(*camera);
-		float *cfv = cameraFromViewer.ptr<float>(0);
-		cameraFromViewer /= cfv[3];
-		
-		// check that the camera is on the correct side of the face
-		cfv = cameraFromViewer.ptr<float>(0);
-		if (cfv[2] > 1 || cfv[2] < -1) {
-			//printf("  Failed test from viewer: %g, %g, %g\n", cfv[0], cfv[1], cfv[2]);
-			continue;
-		}
-		label.viewX = cfv[0];
-		label.viewY = cfv[1];
-		
-		// check that there is no obstacle between the point and the camera
-		int row = (cfv[1] + 1) * depth.rows / 2,
-		    col = (cfv[0] + 1) * depth.cols / 2;
-		if (row < 0 || row >= depth.rows || col < 0 || col > depth.cols)
+	LabelledCameras &filtered = scratch.filtered;
+	ViewerTest &test = scratch.test;
+	filtered.clear();
+	cameras.testViewer(viewer, test);
+	for (int i=0; i<test.index.size(); i++) {
+		// the camera has to be on the correct side of the face, and the point has to be in front of the camera and in its image domain
+		if (!test.passed[i])
 			continue;
-		float obstacleDepth = depth.at<float>(row, col);
-		if (obstacleDepth != backgroundDepth && obstacleDepth <= cfv[2]) {
-			//printf("  Failed depth test: %g >= %g\n", cfv[2], obstacleDepth);
-			continue;
-		}
+		CameraLabel label;
+		label.index = test.index[i];
+		label.viewX = test.viewX[i];
+		label.viewY = test.viewY[i];
+		label.distance = test.distance[i];
 		
-		Mat viewerCenter = extractCameraCenter(viewer);
-		Mat viewerFromCamera = *camera * viewerCenter;
-		float *vfc = viewerFromCamera.ptr<float>(0);
-		label.distance = vfc[3] / viewerCenter.at<float>(3);
-
-		// check that the point is in front of this camera
-		if (label.distance < 0)
+		// the camera has to be in the field of view from the point
+		if (label.viewX < -1 || label.viewX >= 1 || label.viewY < -1 || label.viewY >= 1)
 			continue;
 		
-		// check that the point is projected into image domain by this camera
-		viewerFromCamera /= vfc[3];
-		vfc = viewerFromCamera.ptr<float>(0);
-		if (vfc[0] < -1 || vfc[0] > 1 || vfc[1] < -1 || vfc[1] > 1) {
-			//printf("  Failed test from camera: %g, %g, %g\n", vfc[0], vfc[1], vfc[2]);
-			continue;
-		}
-		
-		// * camera passed all tests *
 		// calculate the cosine of theta
-		label.cosFromViewer = sqrt(1 / (1 + (cfv[0]*cfv[0] + cfv[1]*cfv[1])/(focal*focal)));
-		filtered.push_back(std::pair<CameraLabel, Mat>(label, *camera));
-	}}
+		label.cosFromViewer = sqrt(1 / (1 + (label.viewX*label.viewX + label.viewY*label.viewY)/(focal*focal)));
+		filtered.push_back(label);
+	}
 	//printf(" %i cameras passed visibility tests\n", filtered.size());
-	return filtered;
 }
 
-// Choose a main camera by weighted random shot
-// outWeightSum is an output parameter: the sum of the unmodified weights
-const CameraLabel chooseMain(std::map<unsigned, float> &weights, LabelledCameras filteredCameras, float *outWeightSum, float boostFactor)
+// the end of the segment from a point to the center of the given camera
+static inline void cameraEnd(const CameraTable &cameras, int camera, float *end)
 {
+	const Mat center = cameras.center(camera);
+	for (int k=0; k<3; k++)
+		end[k] = center.at<float>(k) / center.at<float>(3);
+}
+
+// whether there is no obstacle between the point and the given camera
+static bool unblocked(const float *point, const MeshBVH &bvh, const CameraTable &cameras, int camera)
+{
+	float end[3];
+	cameraEnd(cameras, camera, end);
+	return !bvh.occluded(point, end);
+}
+
+// Choose a main camera by weighted random shot from scratch.filtered, or dummyLabel if all of them are blocked
+// a drawn camera blocked by an obstacle is left out and the shot is repeated, which is the same as drawing from the unblocked ones
+// outWeightSum is an output parameter: the sum of the unmodified weights of all the filtered cameras
+const CameraLabel chooseMain(PairWeights &weights, const float *point, const MeshBVH &bvh, const CameraTable &cameras, ShotScratch &scratch, float *outWeightSum, float boostFactor, cv::RNG &random)
+{
+	const LabelledCameras &filteredCameras = scratch.filtered;
 	assert (filteredCameras.size() > 0);
 	
 	// Calculate the weights
-	std::vector<float> weightSum(filteredCameras.size()+1, 0.);
+	scratch.weights.resize(filteredCameras.size());
+	scratch.order.resize(filteredCameras.size());
 	*outWeightSum = 0;
-	{int i=0; for (LabelledCameras::const_iterator it = filteredCameras.begin(); it != filteredCameras.end(); it++, i++) {
-		CameraLabel label = it->first;
+	for (int i=0; i<filteredCameras.size(); i++) {
+		const CameraLabel &label = filteredCameras[i];
 		float weight = label.cosFromViewer/pow2(label.distance);
 		// outWeightSum uses unmodified weights
 		*outWeightSum += weight; 
 		
 		// if this main camera was selected earlier, boost its weight
-		if (weights.count(compact(label.index, label.index)))
+		if (weights.contains(label.index, label.index))
 			weight += weight * boostFactor * filteredCameras.size();
-		weightSum[i+1] = weightSum[i] + weight;
-	}}
+		scratch.weights[i] = weight;
+		scratch.order[i] = i;
+	}
 	
-	// take the random shot
-	float choice = cv::randu<float>() * weightSum.back();
-	int index = bisect(weightSum, choice);
-	// printf("           I shot at %g from %g and thus decided for main camera %i (at position %i), weight %g\n", choice, weightSum.back(), filteredCameras[index].first.index, index, weightSum[index+1] - weightSum[index]);
-	return filteredCameras[index].first;
+	// take the random shot until it hits an unblocked camera
+	while (!scratch.order.empty()) {
+		scratch.sampler.build(scratch.weights);
+		int index = scratch.sampler.draw(random);
+		const CameraLabel &label = filteredCameras[scratch.order[index]];
+		if (unblocked(point, bvh, cameras, label.index))
+			return label;
+		scratch.weights[index] = scratch.weights.back();
+		scratch.weights.pop_back();
+		scratch.order[index] = scratch.order.back();
+		scratch.order.pop_back();
+	}
+	return dummyLabel;
 }
 
-// Choose a side camera by weighted random shot
-const CameraLabel chooseSide(std::map<unsigned, float> &weights, CameraLabel mainCamera, float threshold, float boostFactor, LabelledCameras filteredCameras)
+// Choose a side camera by weighted random shot from scratch.filtered
+// only the cameras strongly connected to the main camera in the co-visibility graph are candidates, unless none of them is filtered;
+// a weak edge shares few tracks, or has a baseline too short for any parallax at the distance of the point
+// then the candidates are tested for obstacles, in a batch
+// the weight added to a pair is normalized by the weights of all the filtered cameras, as without the graph,
+// so that narrowing the candidates does not make the pairs pass the threshold sooner
+const CameraLabel chooseSide(PairWeights &weights, CameraLabel mainCamera, float threshold, float boostFactor, const CovisibilityGraph &graph,
+                             const float *point, const MeshBVH &bvh, const CameraTable &cameras, ShotScratch &scratch, cv::RNG &random)
 {
+	const LabelledCameras &filteredCameras = scratch.filtered;
 	assert (filteredCameras.size() > 1); // mainCamera is surely in filteredCameras and we cannot pick it
 	
 	// Calculate the weights
-	std::vector<float> weightSum(filteredCameras.size(), 0.);
-	std::vector<CameraLabel> labels;
+	LabelledCameras &labels = scratch.sides;
+	labels.clear();
+	scratch.weights.clear();
+	scratch.order.clear();
 	float actualWeightSum = 0;
-	int i=0;
-	for (LabelledCameras::const_iterator it = filteredCameras.begin(); it != filteredCameras.end(); it++) {
-		CameraLabel label = it->first;
+	int strongCount = 0;
+	for (int i=0; i<filteredCameras.size(); i++) {
+		const CameraLabel &label = filteredCameras[i];
 		if (label.index == mainCamera.index)
 			continue;
 		// express the amount of parallax somehow
@@ -388,100 +700,577 @@ const CameraLabel chooseSide(std::map<unsigned, float> &weights, CameraLabel mai
 		actualWeightSum += weight; // sum up the unmodified weights
 		
 		// if this pair of cameras was chosen earlier, boost its weight
-		unsigned compactIndex = compact(mainCamera.index, label.index);
-		if (weights.count(compactIndex) && weights[compactIndex] >= 1)
+		if (weights.contains(mainCamera.index, label.index) && weights(mainCamera.index, label.index) >= 1)
 			weight += weight * boostFactor * filteredCameras.size();
-		weightSum[i+1] = weightSum[i] + weight;
-		labels.push_back(it->first);
-		i++;
+		int edge = graph.edge(mainCamera.index, label.index);
+		bool strong = edge >= 0 && graph.shared[edge] >= minSideTracks && graph.baseline[edge] >= minSideBaseline * mainCamera.distance;
+		strongCount += strong;
+		scratch.weights.push_back(weight);
+		scratch.order.push_back(strong);
+		labels.push_back(label);
+	}
+	
+	// keep the strong candidates, if there are any, and those not blocked
+	scratch.ends.clear();
+	int kept = 0;
+	for (int i=0; i<labels.size(); i++) {
+		if (strongCount > 0 && !scratch.order[i])
+			continue;
+		labels[kept] = labels[i];
+		scratch.weights[kept] = scratch.weights[i];
+		kept++;
+		float end[3];
+		cameraEnd(cameras, labels[i].index, end);
+		scratch.ends.insert(scratch.ends.end(), end, end + 3);
+	}
+	labels.resize(kept);
+	scratch.weights.resize(kept);
+	bvh.occluded(point, scratch.ends, scratch.blocked);
+	kept = 0;
+	for (int i=0; i<labels.size(); i++) {
+		if (scratch.blocked[i])
+			continue;
+		labels[kept] = labels[i];
+		scratch.weights[kept] = scratch.weights[i];
+		kept++;
 	}
+	labels.resize(kept);
+	scratch.weights.resize(kept);
+	
+	if (labels.empty())
+		return dummyLabel;
 	
 	// Take the random shot
-	float choice = cv::randu<float>() * weightSum.back();
-	int index = bisect(weightSum, choice);
-	assert(index >= 0 && index < i);
+	scratch.sampler.build(scratch.weights);
+	int index = scratch.sampler.draw(random);
+	assert(index >= 0 && index < labels.size());
 	
-	unsigned compactIndex = compact(mainCamera.index, labels[index].index);
-	if (weights[compactIndex] >= 1) {
+	float &pairWeight = weights(mainCamera.index, labels[index].index);
+	if (pairWeight >= 1) {
 		// If this pair has been selected before, do not return it
-		//printf("  SKIPPED: I shot at %g from %g and thus decided for side camera %i (at position %i of %i) already picked (%g)\n", choice, weightSum.back(), labels[index].index, index, i, weights[compactIndex]);
 		return dummyLabel;
 	}
 	
-	weights[compact(mainCamera.index, mainCamera.index)] = 1; // just to make a mark
+	weights(mainCamera.index, mainCamera.index) = 1; // just to make a mark
 	
 	// increase the summed value to that camera pair
-	float addWeight = (weightSum[index+1] - weightSum[index]) / (threshold * actualWeightSum);
-	weights[compactIndex] += addWeight;
-	float curWeight = weights[compactIndex];
+	float addWeight = scratch.weights[index] / (threshold * actualWeightSum);
+	float curWeight = (weights(mainCamera.index, labels[index].index) += addWeight);
 	if (curWeight >= 1) {
 		// if the sum passed the threshold, return this pair
-		float parallax = sqrt(pow2(labels[index].viewX - mainCamera.viewX) + pow2(labels[index].viewY - mainCamera.viewY)) / focal;
-		//printf("  PASSED:  I shot at %g from %g and thus decided for side camera %i (at position %i of %i), weight %g * %g, parallax %g\n", choice, weightSum.back(), labels[index].index, index, i, curWeight, threshold * weightSum.back(), parallax);
 		return labels[index];
 	} else {
-		//printf("  FAILED:  I shot at %g from %g and thus decided for side camera %i (at position %i of %i), weight %g * %g\n", choice, weightSum.back(), labels[index].index, index, i, curWeight, threshold * weightSum.back());
 		return dummyLabel;
 	}
 }
 
+static inline float dot3(const float *a, const float *b)
+{
+	return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+// the squared distance of point p from triangle abc, after Ericson: Real-Time Collision Detection, 5.1.5
+static float triangleDistanceSqr(const float *p, const float *a, const float *b, const float *c)
+{
+	float ab[3], ac[3], ap[3], bp[3], cp[3];
+	for (int k=0; k<3; k++) {
+		ab[k] = b[k] - a[k];
+		ac[k] = c[k] - a[k];
+		ap[k] = p[k] - a[k];
+		bp[k] = p[k] - b[k];
+		cp[k] = p[k] - c[k];
+	}
+	// the closest point is a + v*ab + w*ac; find the region of the triangle it lies in
+	float d1 = dot3(ab, ap), d2 = dot3(ac, ap),
+	      d3 = dot3(ab, bp), d4 = dot3(ac, bp),
+	      d5 = dot3(ab, cp), d6 = dot3(ac, cp);
+	float va = d3*d6 - d5*d4, vb = d5*d2 - d1*d6, vc = d1*d4 - d3*d2;
+	float v, w;
+	if (d1 <= 0 && d2 <= 0) {
+		v = 0; w = 0;
+	} else if (d3 >= 0 && d4 <= d3) {
+		v = 1; w = 0;
+	} else if (d6 >= 0 && d5 <= d6) {
+		v = 0; w = 1;
+	} else if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+		v = d1 / (d1 - d3); w = 0;
+	} else if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+		v = 0; w = d2 / (d2 - d6);
+	} else if (va <= 0 && d4 >= d3 && d5 >= d6) {
+		w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+		v = 1 - w;
+	} else {
+		v = vb / (va + vb + vc);
+		w = vc / (va + vb + vc);
+	}
+	float distSqr = 0;
+	for (int k=0; k<3; k++)
+		distSqr += pow2(a[k] + v*ab[k] + w*ac[k] - p[k]);
+	return distSqr;
+}
+
+static void vertexPosition(const Mat vertices, int index, float *out)
+{
+	const float *v = vertices.ptr<float>(index);
+	for (int k=0; k<3; k++)
+		out[k] = v[k] / v[3];
+}
+
+// the length of the diagonal of the bounding box of the mesh
+static float meshSize(const Mesh &mesh)
+{
+	float low[3], high[3], v[3];
+	for (int i=0; i<mesh.vertices.rows; i++) {
+		vertexPosition(mesh.vertices, i, v);
+		for (int k=0; k<3; k++) {
+			low[k] = (i == 0 || v[k] < low[k]) ? v[k] : low[k];
+			high[k] = (i == 0 || v[k] > high[k]) ? v[k] : high[k];
+		}
+	}
+	if (mesh.vertices.rows == 0)
+		return 0;
+	return sqrt(pow2(high[0] - low[0]) + pow2(high[1] - low[1]) + pow2(high[2] - low[2]));
+}
+
+// mark the cached shots whose point still lies on the surface of the mesh, within the given tolerance and with a similar normal
+// the others are in the regions where the mesh has moved, and have to be taken anew
+static void findUnchanged(const Mesh &mesh, const std::vector<CachedShot> &cache, const PointGrid &grid, float tolerance, std::vector<uchar> &unchanged)
+{
+	TraceScope trace("findUnchanged");
+	unchanged.assign(cache.size(), 0);
+	std::vector<int> candidates;
+	for (int i=0; i<mesh.faces.rows; i++) {
+		const int32_t *vertIdx = mesh.faces.ptr<int32_t>(i);
+		float a[3], b[3], c[3], low[3], high[3], normal[3];
+		vertexPosition(mesh.vertices, vertIdx[0], a);
+		vertexPosition(mesh.vertices, vertIdx[1], b);
+		vertexPosition(mesh.vertices, vertIdx[2], c);
+		for (int k=0; k<3; k++) {
+			low[k] = IMIN(a[k], IMIN(b[k], c[k])) - tolerance;
+			high[k] = IMAX(a[k], IMAX(b[k], c[k])) + tolerance;
+		}
+		grid.inBox(low, high, candidates);
+		if (candidates.empty())
+			continue;
+		// oriented the same way as in faceCamera
+		normal[0] = (b[1]-a[1])*(c[2]-b[2]) - (b[2]-a[2])*(c[1]-b[1]);
+		normal[1] = (b[2]-a[2])*(c[0]-b[0]) - (b[0]-a[0])*(c[2]-b[2]);
+		normal[2] = (b[0]-a[0])*(c[1]-b[1]) - (b[1]-a[1])*(c[0]-b[0]);
+		float length = sqrt(dot3(normal, normal));
+		if (length == 0)
+			continue;
+		for (int j=0; j<candidates.size(); j++) {
+			int k = candidates[j];
+			if (!unchanged[k] && dot3(normal, cache[k].normal) >= normalAgreement * length && triangleDistanceSqr(cache[k].point, a, b, c) <= pow2(tolerance))
+				unchanged[k] = 1;
+		}
+	}
+}
+
+// add a (main, side) pair to the chosen bundles; returns false if it was there already
+static bool addPair(std::vector<numberedVector> &chosenCameras, int mainCamera, int sideCamera)
+{
+	int positionMain = myFind(chosenCameras, mainCamera);
+	if (positionMain == -1) {
+		chosenCameras.push_back(numberedVector(mainCamera, std::vector<int>(1, sideCamera)));
+	} else if (myFind(chosenCameras[positionMain].second, sideCamera) == -1) {
+		chosenCameras[positionMain].second.push_back(sideCamera);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// the surface split into bins of a uniform grid, each marked once a shot in it is seen by a chosen (main, side) pair
+class CoverageMap {
+	public:
+		void build(const Mesh &mesh, const std::vector<float> &areas);
+		bool covered(int face) const {return binCovered[faceBin[face]];};
+		void cover(int face);
+		float coverage() const {return (totalArea > 0) ? coveredArea / totalArea : 1;}; // the covered fraction of the surface area
+		int binCount() const {return binArea.size();};
+		int coveredCount() const {return coveredBins;};
+	protected:
+		std::vector<int> faceBin;
+		std::vector<float> binArea;
+		std::vector<uchar> binCovered;
+		float totalArea, coveredArea;
+		int coveredBins;
+};
+
+// faces are assigned to bins by their centroid, the bins are sized so that there are about coverageBins of them on a flat surface
+void CoverageMap::build(const Mesh &mesh, const std::vector<float> &areas)
+{
+	int faceCount = mesh.faces.rows;
+	totalArea = 0;
+	for (int i=0; i<faceCount; i++)
+		totalArea += areas[i];
+	float cellSize = (totalArea > 0) ? sqrt(totalArea / coverageBins) : 1;
+	std::vector<uint64_t> faceKeys(faceCount);
+	for (int i=0; i<faceCount; i++) {
+		const int32_t *vertIdx = mesh.faces.ptr<int32_t>(i);
+		float a[3], b[3], c[3];
+		vertexPosition(mesh.vertices, vertIdx[0], a);
+		vertexPosition(mesh.vertices, vertIdx[1], b);
+		vertexPosition(mesh.vertices, vertIdx[2], c);
+		int cell[3];
+		for (int k=0; k<3; k++)
+			cell[k] = (int)floor((a[k] + b[k] + c[k]) / (3*cellSize));
+		faceKeys[i] = gridKey(cell[0], cell[1], cell[2]);
+	}
+	std::vector<uint64_t> binKeys(faceKeys);
+	std::sort(binKeys.begin(), binKeys.end());
+	binKeys.erase(std::unique(binKeys.begin(), binKeys.end()), binKeys.end());
+	faceBin.resize(faceCount);
+	binArea.assign(binKeys.size(), 0);
+	binCovered.assign(binKeys.size(), 0);
+	for (int i=0; i<faceCount; i++) {
+		faceBin[i] = std::lower_bound(binKeys.begin(), binKeys.end(), faceKeys[i]) - binKeys.begin();
+		binArea[faceBin[i]] += areas[i];
+	}
+	coveredArea = 0;
+	coveredBins = 0;
+}
+
+void CoverageMap::cover(int face)
+{
+	int bin = faceBin[face];
+	if (binCovered[bin])
+		return;
+	binCovered[bin] = 1;
+	coveredArea += binArea[bin];
+	coveredBins += 1;
+}
+
+// whether some chosen pair has both of its cameras among scratch.filtered, with no obstacle between them and the point
+// sides[i] lists the side cameras chosen for the main camera i; marked has to be all zeros, and is left so
+// the obstacles are tested only for the cameras of such pairs, each at most once
+static bool seenByPair(const float *point, const MeshBVH &bvh, const CameraTable &cameras, const std::vector<std::vector<int> > &sides,
+                       std::vector<int> &marked, ShotScratch &scratch)
+{
+	const LabelledCameras &filtered = scratch.filtered;
+	std::vector<signed char> &tested = scratch.tested;
+	tested.assign(filtered.size(), -1);
+	for (int i=0; i<filtered.size(); i++)
+		marked[filtered[i].index] = i + 1;
+	bool seen = false;
+	for (int i=0; i<filtered.size() && !seen; i++) {
+		const std::vector<int> &chosen = sides[filtered[i].index];
+		for (int j=0; j<chosen.size() && !seen; j++) {
+			int position = marked[chosen[j]] - 1;
+			if (position < 0)
+				continue;
+			int ends[2] = {i, position};
+			seen = true;
+			for (int k=0; k<2 && seen; k++) {
+				if (tested[ends[k]] < 0)
+					tested[ends[k]] = unblocked(point, bvh, cameras, filtered[ends[k]].index);
+				seen = tested[ends[k]];
+			}
+		}
+	}
+	for (int i=0; i<filtered.size(); i++)
+		marked[filtered[i].index] = 0;
+	return seen;
+}
+
+// a shot of the camera selection: the cameras seeing a random point on the surface
+// taken by the worker threads in any order, then used for choosing the cameras in the order of shots
+typedef struct {
+	LabelledCameras filtered;
+	cv::RNG random; // the stream of this shot, continued by the choice of cameras
+	int face; // where on the surface the shot was taken
+	float point[3], normal[3];
+	int cached; // the cached shot reused instead of rendering, or -1
+	bool finished;
+} Shot;
+
+// data shared by the threads taking the shots
+typedef struct {
+	const Mesh *mesh;
+	const CameraTable *cameras;
+	const AliasTable *faceSampler;
+	const std::vector<CachedShot> *cache; // the shots of the previous iteration, with --incremental
+	const std::vector<uchar> *unchanged; // which of them still lie on the surface
+	const PointGrid *cacheGrid;
+	float tolerance; // the distance up to which a cached shot is reused (0 = never)
+	uint64_t seed;
+	std::vector<Shot> shots;
+	int nextShot; // the first shot not taken by any worker yet
+	int consumed; // the number of shots already used for choosing the cameras
+	int lookahead; // how many shots the workers may take beyond those consumed
+	int shotLimit; // no shot is taken from here on, set once the cameras have been chosen
+	Monitor monitor; // guards shots, nextShot, consumed and shotLimit
+} ShotState;
+
+// initial state of the random stream of the given shot, so that it does not depend on the thread taking the shot
+// (the splitmix64 finalizer applied to a counter)
+static uint64_t shotSeed(uint64_t seed, int shotNo)
+{
+	uint64_t z = seed + (uint64_t)(shotNo + 1) * 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z = z ^ (z >> 31);
+	return z ? z : 1;
+}
+
+// the nearest unchanged cached shot within the tolerance and with a similar normal, or -1
+static int findCachedShot(const ShotState &state, const float *point, const float *normal, std::vector<int> &candidates)
+{
+	float low[3], high[3];
+	for (int k=0; k<3; k++) {
+		low[k] = point[k] - state.tolerance;
+		high[k] = point[k] + state.tolerance;
+	}
+	state.cacheGrid->inBox(low, high, candidates);
+	int best = -1;
+	float bestDistSqr = pow2(state.tolerance);
+	for (int i=0; i<candidates.size(); i++) {
+		int k = candidates[i];
+		const CachedShot &cached = (*state.cache)[k];
+		if (!(*state.unchanged)[k] || dot3(normal, cached.normal) < normalAgreement)
+			continue;
+		float distSqr = pow2(point[0] - cached.point[0]) + pow2(point[1] - cached.point[1]) + pow2(point[2] - cached.point[2]);
+		// ties are broken by the index, so that the result does not depend on the order of the candidates
+		if (distSqr < bestDistSqr || (distSqr == bestDistSqr && (best < 0 || k < best))) {
+			best = k;
+			bestDistSqr = distSqr;
+		}
+	}
+	return best;
+}
+
+// body of a shooting thread: find the cameras seeing a random point on the surface
+// with --incremental, a point near a shot of the previous iteration where the surface has not moved reuses that shot instead
+void shotWorker(int threadNo, void *arg)
+{
+	ShotState *state = (ShotState*)arg;
+	ShotScratch scratch;
+	while (1) {
+		int shotNo;
+		{
+			MonitorLock lock(state->monitor);
+			// the main thread decides when to stop, so the workers stay only a few shots ahead of it
+			while (state->nextShot < state->shotLimit && state->nextShot >= state->consumed + state->lookahead)
+				state->monitor.wait();
+			if (state->nextShot >= state->shotLimit)
+				break;
+			shotNo = state->nextShot++;
+		}
+		cv::RNG random(shotSeed(state->seed, shotNo));
+		
+		// select a face by weighted randomness
+		int chosenIdx = state->faceSampler->draw(random);
+		
+		// a view of the scene from that face
+		float far = 10; // fixme, may fail. Should be calculated from the scene geometry
+		float point[3], normal[3];
+		Mat viewer = faceCamera(*state->mesh, chosenIdx, far, focal, random, point, normal);
+		int cached = (state->tolerance > 0) ? findCachedShot(*state, point, normal, scratch.candidates) : -1;
+		if (cached >= 0) {
+			scratch.filtered = (*state->cache)[cached].filtered;
+		} else {
+			// filter out cameras that do not display this point correctly
+			filterCameras(viewer, *state->cameras, scratch);
+		}
+		
+		MonitorLock lock(state->monitor);
+		Shot &shot = state->shots[shotNo];
+		shot.filtered = scratch.filtered;
+		shot.random = random;
+		shot.face = chosenIdx;
+		for (int k=0; k<3; k++) {
+			shot.point[k] = point[k];
+			shot.normal[k] = normal[k];
+		}
+		shot.cached = cached;
+		shot.finished = true;
+		state->monitor.broadcast();
+	}
+}
+
 // Choose all camera bundles (1 x main, n x side) for an update iteration
-int Heuristic::chooseCameras(const Mesh mesh, const std::vector<Mat> cameras)
+// with --coverage, shots are taken until the chosen pairs see enough of the surface, or until no more pairs come out of them
+// the shots are taken in parallel, each with its own random stream, and processed in order, so the result does not depend on the thread count
+// with --incremental, the bundles chosen in the previous iteration are kept where the mesh has not moved, and so are the pair weights
+int Heuristic::chooseCameras(const Mesh mesh, const CameraTable &cameras)
 {
+	TraceScope trace("chooseCameras");
 	chosenCameras.clear();
 	int cameraCount = 0;
-	std::vector<float> areaSum(mesh.faces.rows+1, 0.);
+	bool incremental = (config->incrementalTolerance > 0);
+	PairWeights weights;
+	std::vector<uchar> unchanged;
+	PointGrid cacheGrid;
+	float tolerance = 0;
+	if (incremental && !shotCache.empty()) {
+		float size = meshSize(mesh);
+		tolerance = config->incrementalTolerance * size;
+		std::vector<float> cachedPoints(3*shotCache.size());
+		for (int i=0; i<shotCache.size(); i++) {
+			for (int k=0; k<3; k++)
+				cachedPoints[3*i + k] = shotCache[i].point[k];
+		}
+		// finer cells would make the large faces visit too many of them
+		cacheGrid.build(&cachedPoints[0], shotCache.size(), IMAX(tolerance, size/64));
+		findUnchanged(mesh, shotCache, cacheGrid, tolerance, unchanged);
+		weights = pairWeights;
+		
+		// keep the pairs chosen where the surface has not moved, forget the others so that they can be chosen again
+		for (int i=0; i<shotCache.size(); i++) {
+			if (!unchanged[i])
+				continue;
+			for (int j=0; j<shotCache[i].pairs.size(); j++) {
+				if (addPair(chosenCameras, shotCache[i].pairs[j].first, shotCache[i].pairs[j].second))
+					cameraCount += 1;
+			}
+		}
+		for (int i=0; i<shotCache.size(); i++) {
+			if (unchanged[i])
+				continue;
+			for (int j=0; j<shotCache[i].pairs.size(); j++) {
+				int mainCamera = shotCache[i].pairs[j].first, sideCamera = shotCache[i].pairs[j].second;
+				int positionMain = myFind(chosenCameras, mainCamera);
+				if (positionMain == -1 || myFind(chosenCameras[positionMain].second, sideCamera) == -1)
+					weights(mainCamera, sideCamera) = 0;
+			}
+		}
+		if (config->verbosity >= 2)
+			printf(" %i of %i cached shots unchanged, keeping %i camera pairs\n", (int)std::count(unchanged.begin(), unchanged.end(), 1), (int)shotCache.size(), cameraCount);
+	}
+	std::vector<float> areas(mesh.faces.rows);
+	float totalArea = 0;
 	for (int i=0; i<mesh.faces.rows; i++) {
 		const int32_t *vertIdx = mesh.faces.ptr<int32_t>(i);
-		areaSum[i+1] = areaSum[i] + faceArea(mesh.vertices, vertIdx[0], vertIdx[1], vertIdx[2]);
+		areas[i] = faceArea(mesh.vertices, vertIdx[0], vertIdx[1], vertIdx[2]);
+		totalArea += areas[i];
 	}
-	float totalArea = areaSum.back(),
-	      average = totalArea / mesh.faces.rows;
+	AliasTable faceSampler;
+	faceSampler.build(areas);
 	
 	float samplingResolution = sqrt(cameras.size())*config->width*config->height/(totalArea * config->cameraThreshold); // units: pixels per scene-space area
-	std::vector<bool> used(false, mesh.faces.rows);
-	cv::RNG random = cv::theRNG();
-	Render *render = spawnRender(*this);
-	render->loadMesh(mesh);
-	std::vector<int> empty;
-	int shotCount = 200;
-	// table indexed by calling compact(i,j) on two indices
-	std::map<unsigned, float> weights; 
-	for (int i = 0; i < shotCount; i ++) {
-		// select a face by weighted randomness
-		float choice = cv::randu<float>() * totalArea;
-		int chosenIdx = bisect(areaSum, choice);
-		
-		// render a view of the scene from that face
-		float far = 10; // fixme, may fail. Should be calculated from the scene geometry
-		Mat viewer = faceCamera(mesh, chosenIdx, far, focal);
-		Mat depth = render->depth(viewer);
-		
-		// filter out cameras that do not display this point correctly
-		LabelledCameras filteredCameras = filterCameras(viewer, depth, cameras);
-		if (filteredCameras.size() >= 2) {
+	bool adaptive = (config->coverageTarget > 0);
+	int maxShots = adaptive ? 10*nominalShots : nominalShots;
+	CoverageMap coverage;
+	coverage.build(mesh, areas);
+	
+	const CovisibilityGraph &graph = config->covisibility();
+	
+	// the pairs chosen so far (weight of at least 1), by their main camera, for the coverage test
+	std::vector<std::vector<int> > chosenSides(cameras.size());
+	std::vector<int> marked(cameras.size(), 0);
+	for (size_t s=0; s<weights.slotCount(); s++) {
+		int mainNo, sideNo;
+		float weight;
+		if (weights.entry(s, mainNo, sideNo, weight) && mainNo != sideNo && weight >= 1)
+			chosenSides[mainNo].push_back(sideNo);
+	}
+	
+	// the obstacles between the surface and the cameras are found without rendering
+	MeshBVH bvh;
+	bvh.build(mesh);
+	
+	ShotState state;
+	state.mesh = &mesh;
+	state.cameras = &cameras;
+	state.faceSampler = &faceSampler;
+	state.cache = &shotCache;
+	state.unchanged = &unchanged;
+	state.cacheGrid = &cacheGrid;
+	state.tolerance = tolerance;
+	// a single draw from the global generator, so that it stays reproducible
+	// the halves are drawn in separate statements, the order of evaluation within one expression is unspecified
+	uint64_t seedHigh = cv::theRNG().next();
+	uint64_t seedLow = cv::theRNG().next();
+	state.seed = seedHigh << 32 | seedLow;
+	state.shots.resize(maxShots);
+	for (int i=0; i<maxShots; i++)
+		state.shots[i].finished = false;
+	state.nextShot = 0;
+	state.consumed = 0;
+	state.lookahead = 2*IMAX(config->threadCount, 1);
+	state.shotLimit = maxShots;
+	ThreadGroup shooters;
+	shooters.start(IMAX(config->threadCount, 1), shotWorker, &state);
+	
+	ShotScratch scratch;
+	std::vector<CachedShot> nextCache;
+	std::vector<uchar> inherited(shotCache.size(), 0);
+	int shotCount = 0, lastNewPair = -1;
+	const char *stopReason = "shot limit reached";
+	for (int i = 0; i < maxShots; i ++) {
+		{
+			MonitorLock lock(state.monitor);
+			while (!state.shots[i].finished)
+				state.monitor.wait();
+			scratch.filtered.swap(state.shots[i].filtered);
+		}
+		cv::RNG &random = state.shots[i].random;
+		const Shot &shot = state.shots[i];
+		if (incremental) {
+			nextCache.push_back(CachedShot());
+			CachedShot &entry = nextCache.back();
+			std::copy(shot.point, shot.point + 3, entry.point);
+			std::copy(shot.normal, shot.normal + 3, entry.normal);
+			entry.filtered = scratch.filtered;
+			// the pairs kept from a reused shot move over to the first shot reusing it
+			if (shot.cached >= 0 && !inherited[shot.cached]) {
+				entry.pairs = shotCache[shot.cached].pairs;
+				inherited[shot.cached] = 1;
+			}
+		}
+		if (scratch.filtered.size() >= 2) {
 			// try to pick a (main, side) camera pair
 			float mainWeightSum;
-			CameraLabel mainCamera = chooseMain(weights, filteredCameras, &mainWeightSum, config->cameraThreshold);
-			CameraLabel sideCamera = chooseSide(weights, mainCamera, shotCount * mainWeightSum/samplingResolution, config->cameraThreshold/10, filteredCameras);
-			if (sideCamera.index == dummyLabel.index) {
-				// no new pair picked (or none at all)
-				continue;
-			}
-			
-			cameraCount += 1;
-			// write the pair into the resulting table
-			int positionMain = myFind(chosenCameras, mainCamera.index);
-			if (positionMain == -1) {
-				chosenCameras.push_back(numberedVector(mainCamera.index, std::vector<int>(1, sideCamera.index)));
-			} else if (myFind(chosenCameras[positionMain].second, sideCamera.index) == -1) {
-				chosenCameras[positionMain].second.push_back(sideCamera.index);
+			CameraLabel mainCamera = chooseMain(weights, shot.point, bvh, cameras, scratch, &mainWeightSum, config->cameraThreshold, random);
+			CameraLabel sideCamera = dummyLabel;
+			if (mainCamera.index != dummyLabel.index)
+				sideCamera = chooseSide(weights, mainCamera, nominalShots * mainWeightSum/samplingResolution, config->cameraThreshold/10, graph,
+				                        shot.point, bvh, cameras, scratch, random);
+			if (sideCamera.index != dummyLabel.index) {
+				cameraCount += 1;
+				lastNewPair = i;
+				// write the pair into the resulting table
+				addPair(chosenCameras, mainCamera.index, sideCamera.index);
+				chosenSides[mainCamera.index].push_back(sideCamera.index);
+				if (incremental)
+					nextCache.back().pairs.push_back(std::make_pair(mainCamera.index, sideCamera.index));
 			}
+			if (!coverage.covered(shot.face) && seenByPair(shot.point, bvh, cameras, chosenSides, marked, scratch))
+				coverage.cover(shot.face);
 		} else {
 			// no camera pair available for this point on the scene surface
 		}
+		shotCount = i+1;
+		
+		bool stop = false;
+		if (adaptive && coverage.coverage() >= config->coverageTarget) {
+			stop = true;
+			stopReason = "coverage reached";
+		} else if (adaptive && i - lastNewPair >= nominalShots) {
+			stop = true;
+			stopReason = "no new pairs";
+		}
+		MonitorLock lock(state.monitor);
+		state.consumed = shotCount;
+		if (stop)
+			state.shotLimit = shotCount;
+		state.monitor.broadcast();
+		if (stop)
+			break;
+	}
+	shooters.join();
+	if (config->verbosity >= 2)
+		printf(" %i shots (%s), %i camera pairs, %.1f%% of the surface covered (%i of %i bins)\n", shotCount, adaptive ? stopReason : "fixed count", cameraCount, 100*coverage.coverage(), coverage.coveredCount(), coverage.binCount());
+	if (incremental) {
+		// the kept pairs whose shot was not taken again stay with their old shot
+		for (int i=0; i<shotCache.size(); i++) {
+			if (unchanged[i] && !inherited[i] && !shotCache[i].pairs.empty())
+				nextCache.push_back(shotCache[i]);
+		}
+		shotCache.swap(nextCache);
+		pairWeights = weights;
 	}
-	delete render;
 	
 	// make the list a bit nicer
 	std::sort(chosenCameras.begin(), chosenCameras.end());
@@ -525,8 +1314,9 @@ int Heuristic::nextSide(int imain)
 }
 
 // Polygonize the supplied point cloud using an appropriate method
-Mesh Heuristic::tessellate(const Mat points, const Mat normals)
+Mesh Heuristic::tessellate(const PointStore &points)
 {
+	TraceScope trace("tessellate");
 	if (iteration <= 1) {
 		if (config->inMeshFile) {
 			Mesh result = readMesh(config->inMeshFile);
@@ -535,18 +1325,41 @@ Mesh Heuristic::tessellate(const Mat points, const Mat normals)
 			return result;
 			assert(false);
 		} else {
+			// the initial cloud is small and becomes the vertices of the mesh
+			Mat vertices = points.points();
 			float alpha;
-			Mat faces = alphaShapeFaces(points, &alpha);
+			Mat faces = alphaShapeFaces(vertices, &alpha);
 			alphaVals.push_back(alpha);
-			return Mesh(points, faces);
+			return Mesh(vertices, faces);
 		}
 	} else {
-		Mesh result = poissonSurface(points, normals);
+		Mesh result = poissonSurface(points);
 		alphaVals.push_back(alphaVals.back() / 2);
 		return result;
 	}
 }
 
+// store the state of the heuristic into a checkpoint
+void Heuristic::saveState(Checkpoint &checkpoint) const
+{
+	checkpoint.iteration = iteration;
+	checkpoint.alphaVals = alphaVals;
+	checkpoint.chosenCameras = chosenCameras;
+	checkpoint.shotCache = shotCache;
+	checkpoint.pairWeights = pairWeights;
+}
+
+// continue from a checkpoint; the next call to notHappy() returns to the iteration in progress
+void Heuristic::restoreState(const Checkpoint &checkpoint)
+{
+	// a checkpoint from the middle of tracking has to repeat its iteration (without meshing and choosing cameras)
+	iteration = (checkpoint.phase == Checkpoint::tracking) ? checkpoint.iteration - 1 : checkpoint.iteration;
+	alphaVals = checkpoint.alphaVals;
+	chosenCameras = checkpoint.chosenCameras;
+	shotCache = checkpoint.shotCache;
+	pairWeights = checkpoint.pairWeights;
+}
+
 // extract frame render size from the configuration (for reprojection)
 cv::Size Heuristic::renderSize()
 {
@@ -0,0 +1,223 @@
+// mesh_bvh.cpp: a bounding volume hierarchy over the faces of a mesh, for visibility tests on the CPU
+// each leaf holds up to four faces stored side by side, so that a segment is tested against all of them at once
+
+#include "recon.hpp"
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#ifdef __SSE__
+	#include <xmmintrin.h>
+#endif
+
+// a segment ending this close to its start (relative to its length) does not count as occluded,
+// so that the face the segment starts on does not hide it
+const float occlusionEpsilon = 1e-3;
+
+// orders faces by the center of their bounding box along a single axis
+typedef struct FaceCenterLess {
+	const std::vector<float> *boxes;
+	int axis;
+	FaceCenterLess(const std::vector<float> *b, int a):boxes(b), axis(a) {};
+	bool operator()(int a, int b) const {
+		return (*boxes)[6*a + axis] + (*boxes)[6*a + 3 + axis] < (*boxes)[6*b + axis] + (*boxes)[6*b + 3 + axis];
+	};
+} FaceCenterLess;
+
+static void vertexPosition(const Mat vertices, int index, float *out)
+{
+	const float *v = vertices.ptr<float>(index);
+	for (int k=0; k<3; k++)
+		out[k] = v[k] / v[3];
+}
+
+void MeshBVH::build(const Mesh &mesh)
+{
+	TraceScope trace("buildMeshBVH");
+	int faceCount = mesh.faces.rows;
+	// vertices and bounding box of each face, only needed while building
+	std::vector<float> corners(9*faceCount), boxes(6*faceCount);
+	for (int i=0; i<faceCount; i++) {
+		const int32_t *vertIdx = mesh.faces.ptr<int32_t>(i);
+		float *corner = &corners[9*i];
+		for (int j=0; j<3; j++)
+			vertexPosition(mesh.vertices, vertIdx[j], corner + 3*j);
+		float *box = &boxes[6*i];
+		for (int k=0; k<3; k++) {
+			box[k] = IMIN(corner[k], IMIN(corner[3+k], corner[6+k]));
+			box[3+k] = IMAX(corner[k], IMAX(corner[3+k], corner[6+k]));
+		}
+	}
+	std::vector<int> order(faceCount);
+	for (int i=0; i<faceCount; i++)
+		order[i] = i;
+	nodes.clear();
+	for (int k=0; k<9; k++)
+		packets[k].clear();
+	if (faceCount > 0)
+		buildNode(corners, boxes, order, 0, faceCount);
+}
+
+// create the node holding faces order[begin, ..., end-1] and its subtree; returns the index of the node
+int MeshBVH::buildNode(const std::vector<float> &corners, const std::vector<float> &boxes, std::vector<int> &order, int begin, int end)
+{
+	int nodeNo = nodes.size();
+	nodes.push_back(Node());
+	Node node;
+	for (int k=0; k<3; k++) {
+		node.box[k] = std::numeric_limits<float>::infinity();
+		node.box[3+k] = -std::numeric_limits<float>::infinity();
+	}
+	for (int i=begin; i<end; i++) {
+		const float *box = &boxes[6*order[i]];
+		for (int k=0; k<3; k++) {
+			node.box[k] = IMIN(node.box[k], box[k]);
+			node.box[3+k] = IMAX(node.box[3+k], box[3+k]);
+		}
+	}
+	if (end - begin <= 4) {
+		// a leaf: store the first vertex and both edges of each face, unused slots stay degenerate
+		node.packet = packets[0].size() / 4;
+		node.right = -1;
+		for (int k=0; k<9; k++)
+			packets[k].resize(packets[k].size() + 4, 0);
+		for (int i=begin; i<end; i++) {
+			const float *corner = &corners[9*order[i]];
+			int slot = 4*node.packet + i - begin;
+			for (int k=0; k<3; k++) {
+				packets[k][slot] = corner[k];
+				packets[3+k][slot] = corner[3+k] - corner[k];
+				packets[6+k][slot] = corner[6+k] - corner[k];
+			}
+		}
+	} else {
+		int axis = 0;
+		for (int k=1; k<3; k++) {
+			if (node.box[3+k] - node.box[k] > node.box[3+axis] - node.box[axis])
+				axis = k;
+		}
+		int middle = (begin + end) / 2;
+		std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, FaceCenterLess(&boxes, axis));
+		node.packet = -1;
+		// the left child directly follows its parent
+		buildNode(corners, boxes, order, begin, middle);
+		node.right = buildNode(corners, boxes, order, middle, end);
+	}
+	nodes[nodeNo] = node;
+	return nodeNo;
+}
+
+// whether the segment from + t*dir, t in (tMin, 1), hits a face in the given packet (Moeller & Trumbore)
+bool MeshBVH::hitsPacket(int packet, const float *from, const float *dir, float tMin) const
+{
+	int i = 4*packet;
+	#ifdef __SSE__
+	__m128 v0[3], e1[3], e2[3], d[3], o[3];
+	for (int k=0; k<3; k++) {
+		v0[k] = _mm_loadu_ps(&packets[k][i]);
+		e1[k] = _mm_loadu_ps(&packets[3+k][i]);
+		e2[k] = _mm_loadu_ps(&packets[6+k][i]);
+		d[k] = _mm_set1_ps(dir[k]);
+		o[k] = _mm_sub_ps(_mm_set1_ps(from[k]), v0[k]);
+	}
+	// p = dir x e2, q = o x e1
+	__m128 p[3], q[3];
+	for (int k=0; k<3; k++) {
+		int k1 = (k+1) % 3, k2 = (k+2) % 3;
+		p[k] = _mm_sub_ps(_mm_mul_ps(d[k1], e2[k2]), _mm_mul_ps(d[k2], e2[k1]));
+		q[k] = _mm_sub_ps(_mm_mul_ps(o[k1], e1[k2]), _mm_mul_ps(o[k2], e1[k1]));
+	}
+	__m128 det = _mm_setzero_ps(), u = _mm_setzero_ps(), v = _mm_setzero_ps(), t = _mm_setzero_ps();
+	for (int k=0; k<3; k++) {
+		det = _mm_add_ps(det, _mm_mul_ps(e1[k], p[k]));
+		u = _mm_add_ps(u, _mm_mul_ps(o[k], p[k]));
+		v = _mm_add_ps(v, _mm_mul_ps(d[k], q[k]));
+		t = _mm_add_ps(t, _mm_mul_ps(e2[k], q[k]));
+	}
+	// degenerate faces (including the unused slots) have a zero determinant and fail the first test
+	__m128 absDet = _mm_max_ps(det, _mm_sub_ps(_mm_setzero_ps(), det));
+	__m128 inverse = _mm_div_ps(_mm_set1_ps(1), det);
+	u = _mm_mul_ps(u, inverse);
+	v = _mm_mul_ps(v, inverse);
+	t = _mm_mul_ps(t, inverse);
+	__m128 hit = _mm_cmpgt_ps(absDet, _mm_set1_ps(std::numeric_limits<float>::min()));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(u, _mm_setzero_ps()), _mm_cmpge_ps(v, _mm_setzero_ps())));
+	hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1)));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(tMin)), _mm_cmplt_ps(t, _mm_set1_ps(1))));
+	return _mm_movemask_ps(hit) != 0;
+	#else
+	for (int j=i; j<i+4; j++) {
+		float v0[3], e1[3], e2[3], o[3], p[3], q[3];
+		for (int k=0; k<3; k++) {
+			v0[k] = packets[k][j];
+			e1[k] = packets[3+k][j];
+			e2[k] = packets[6+k][j];
+			o[k] = from[k] - v0[k];
+		}
+		for (int k=0; k<3; k++) {
+			int k1 = (k+1) % 3, k2 = (k+2) % 3;
+			p[k] = dir[k1]*e2[k2] - dir[k2]*e2[k1];
+			q[k] = o[k1]*e1[k2] - o[k2]*e1[k1];
+		}
+		float det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+		if (fabs(det) <= std::numeric_limits<float>::min())
+			continue;
+		float u = (o[0]*p[0] + o[1]*p[1] + o[2]*p[2]) / det,
+		      v = (dir[0]*q[0] + dir[1]*q[1] + dir[2]*q[2]) / det,
+		      t = (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2]) / det;
+		if (u >= 0 && v >= 0 && u + v <= 1 && t > tMin && t < 1)
+			return true;
+	}
+	return false;
+	#endif
+}
+
+// whether any face lies between the points from and to
+bool MeshBVH::occluded(const float *from, const float *to) const
+{
+	if (nodes.empty())
+		return false;
+	float dir[3], inverse[3];
+	for (int k=0; k<3; k++) {
+		dir[k] = to[k] - from[k];
+		inverse[k] = 1 / dir[k];
+	}
+	std::vector<int> stack(1, 0);
+	while (!stack.empty()) {
+		int nodeNo = stack.back();
+		const Node &node = nodes[nodeNo];
+		stack.pop_back();
+		// clip the segment by the slabs of the box
+		float tNear = 0, tFar = 1;
+		for (int k=0; k<3; k++) {
+			float t1 = (node.box[k] - from[k]) * inverse[k],
+			      t2 = (node.box[3+k] - from[k]) * inverse[k];
+			if (dir[k] == 0) {
+				// parallel to the slab, inside it or not at all
+				bool outside = (from[k] < node.box[k] || from[k] > node.box[3+k]);
+				t1 = outside ? 2 : -1;
+				t2 = 2;
+			}
+			tNear = IMAX(tNear, IMIN(t1, t2));
+			tFar = IMIN(tFar, IMAX(t1, t2));
+		}
+		if (tNear > tFar)
+			continue;
+		if (node.right < 0) {
+			if (hitsPacket(node.packet, from, dir, occlusionEpsilon))
+				return true;
+		} else {
+			stack.push_back(node.right);
+			stack.push_back(nodeNo + 1);
+		}
+	}
+	return false;
+}
+
+// test the segments from a single point to each of the given points (three coordinates each)
+void MeshBVH::occluded(const float *from, const std::vector<float> &to, std::vector<uchar> &result) const
+{
+	int count = to.size() / 3;
+	result.resize(count);
+	for (int i=0; i<count; i++)
+		result[i] = occluded(from, &to[3*i]);
+}
@@ -0,0 +1,200 @@
+// parallel.cpp: thin wrappers around POSIX threads, used to spread the work over several cores
+
+#include "recon.hpp"
+#include <cstdio>
+#include <cstdlib>
+
+Monitor::Monitor()
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&condition, NULL);
+}
+
+Monitor::~Monitor()
+{
+	pthread_cond_destroy(&condition);
+	pthread_mutex_destroy(&mutex);
+}
+
+void Monitor::lock()
+{
+	pthread_mutex_lock(&mutex);
+}
+
+void Monitor::unlock()
+{
+	pthread_mutex_unlock(&mutex);
+}
+
+// release the lock until someone calls broadcast(), then lock it again
+void Monitor::wait()
+{
+	pthread_cond_wait(&condition, &mutex);
+}
+
+void Monitor::broadcast()
+{
+	pthread_cond_broadcast(&condition);
+}
+
+// start the given number of threads, each calling function(threadNo, arg)
+void ThreadGroup::start(int threadCount, Function function, void *arg)
+{
+	threads.resize(threadCount);
+	tasks.resize(threadCount);
+	for (int i=0; i<threadCount; i++) {
+		tasks[i].function = function;
+		tasks[i].arg = arg;
+		tasks[i].threadNo = i;
+	}
+	// the tasks vector must not be reallocated from now on, threads keep pointers into it
+	for (int i=0; i<threadCount; i++) {
+		if (pthread_create(&threads[i], NULL, ThreadGroup::run, &tasks[i]) != 0) {
+			fprintf(stderr, "Cannot start a worker thread, exiting.\n");
+			exit(1);
+		}
+	}
+}
+
+// wait until all the threads have finished
+void ThreadGroup::join()
+{
+	for (int i=0; i<threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	threads.clear();
+	tasks.clear();
+}
+
+// entry point of each thread, unpacks the task and calls the actual function
+void *ThreadGroup::run(void *arg)
+{
+	Task *task = (Task*)arg;
+	task->function(task->threadNo, task->arg);
+	return NULL;
+}
+
+WorkerPool::WorkerPool(int ithreadCount)
+{
+	threadCount = IMAX(ithreadCount, 1);
+	generation = 0;
+	working = 0;
+	stopping = false;
+	count = chunkSize = nextChunk = 0;
+	body = NULL;
+	arg = NULL;
+	if (threadCount > 1)
+		helpers.start(threadCount - 1, WorkerPool::helper, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		MonitorLock lock(monitor);
+		stopping = true;
+		monitor.broadcast();
+	}
+	helpers.join();
+}
+
+// body of a helper thread: wait for each loop and take its chunks with the others
+void WorkerPool::helper(int threadNo, void *arg)
+{
+	WorkerPool *pool = (WorkerPool*)arg;
+	int done = 0;
+	while (1) {
+		{
+			MonitorLock lock(pool->monitor);
+			while (pool->generation == done && !pool->stopping)
+				pool->monitor.wait();
+			if (pool->stopping)
+				break;
+			done = pool->generation;
+		}
+		pool->runChunks();
+		MonitorLock lock(pool->monitor);
+		if (--pool->working == 0)
+			pool->monitor.broadcast();
+	}
+}
+
+// take the chunks of the current loop until there are none left
+void WorkerPool::runChunks()
+{
+	while (1) {
+		int begin;
+		{
+			MonitorLock lock(monitor);
+			begin = nextChunk * chunkSize;
+			nextChunk ++;
+		}
+		if (begin >= count)
+			break;
+		body(begin, IMIN(begin + chunkSize, count), arg);
+	}
+}
+
+// call body(begin, end, arg) for consecutive ranges of chunkSize indices covering 0, ..., count-1, using all the threads of the pool
+// the ranges do not depend on the number of threads, so results combined per range are deterministic
+void WorkerPool::parallelFor(int icount, int ichunkSize, RangeFunction ibody, void *iarg)
+{
+	int chunkCount = (icount + ichunkSize - 1) / ichunkSize;
+	if (threadCount <= 1 || chunkCount <= 1) {
+		for (int begin=0; begin<icount; begin+=ichunkSize)
+			ibody(begin, IMIN(begin + ichunkSize, icount), iarg);
+		return;
+	}
+	{
+		MonitorLock lock(monitor);
+		count = icount;
+		chunkSize = ichunkSize;
+		nextChunk = 0;
+		body = ibody;
+		arg = iarg;
+		working = threadCount - 1;
+		generation ++;
+		monitor.broadcast();
+	}
+	runChunks();
+	// the helpers may still be running their last chunks
+	MonitorLock lock(monitor);
+	while (working > 0)
+		monitor.wait();
+}
+
+// deal the tasks to workers in turns, so that the lowest indices get processed first
+WorkStealingQueue::WorkStealingQueue(int taskCount, int iworkerCount)
+{
+	workerCount = iworkerCount;
+	tasks.resize(workerCount);
+	locks = new Monitor[workerCount];
+	for (int i=0; i<taskCount; i++)
+		tasks[i % workerCount].push_back(i);
+}
+
+WorkStealingQueue::~WorkStealingQueue()
+{
+	delete[] locks;
+}
+
+// take the next task of the given worker; if there is none, steal the last one from another worker
+int WorkStealingQueue::pop(int workerNo)
+{
+	{
+		MonitorLock lock(locks[workerNo]);
+		if (!tasks[workerNo].empty()) {
+			int task = tasks[workerNo].front();
+			tasks[workerNo].pop_front();
+			return task;
+		}
+	}
+	for (int i=1; i<workerCount; i++) {
+		int victim = (workerNo + i) % workerCount;
+		MonitorLock lock(locks[victim]);
+		if (!tasks[victim].empty()) {
+			int task = tasks[victim].back();
+			tasks[victim].pop_back();
+			return task;
+		}
+	}
+	return WorkStealingQueue::empty;
+}
@@ -58,6 +58,36 @@ NormalCloud::Ptr convert(const Mat points, const Mat normals)
 	return cloud;
 }
 
+#ifndef TEST_BUILD
+// convert our block-wise point store for PCL, scaling the normals as above
+NormalCloud::Ptr convert(const PointStore &points)
+{
+	NormalCloud::Ptr cloud(new NormalCloud);
+	
+	double normalSumSize = 1;
+	for (int b=0; b<points.blockCount(); b++) {
+		const float *nx = points.column(b, PointStore::normalX), *ny = points.column(b, PointStore::normalY), *nz = points.column(b, PointStore::normalZ);
+		for (int i=0; i<points.blockLength(b); i++)
+			normalSumSize += sqrt(P2(nx[i]) + P2(ny[i]) + P2(nz[i]));
+	}
+	double normalScaling = points.size() / normalSumSize;
+	
+	cloud->reserve(points.size());
+	for (int b=0; b<points.blockCount(); b++) {
+		const float *w = points.column(b, PointStore::posW);
+		for (int i=0; i<points.blockLength(b); i++) {
+			pcl::PointNormal p;
+			for (char j=0; j<3; j++) {
+				p.data[j] = points.column(b, PointStore::posX + j)[i] / w[i];
+				p.normal[j] = points.column(b, PointStore::normalX + j)[i] * normalScaling;
+			}
+			cloud->push_back(p);
+		}
+	}
+	return cloud;
+}
+#endif
+
 // convert an uncommon PCL mesh representation to ours
 void convert(Mesh dst, std::vector<pcl::Vertices> faces)
 {
@@ -190,10 +220,8 @@ float boundingBoxSize(const Mat points)
 }
 
 // calculate the isosurface of the Poisson reconstructed volume
-Mesh poissonSurface(const Mat points, const Mat normals, int degree)
+Mesh poissonSurface(NormalCloud::Ptr cloud, int degree)
 {
-	NormalCloud::Ptr cloud(convert(points, normals));
-	
 	pcl::Poisson<pcl::PointNormal> poisson;
 	// use precision of the triangulated points
 	// may be better to disable, sometimes does more harm than use
@@ -222,11 +250,18 @@ Mesh poissonSurface(const Mat points, const Mat normals, int degree)
 	return result;
 }
 
-Mesh poissonSurface(const Mat points, const Mat normals)
+Mesh poissonSurface(const Mat points, const Mat normals, int degree)
 {
-	return poissonSurface(points, normals, 4);
+	return poissonSurface(convert(points, normals), degree);
 }
 
+#ifndef TEST_BUILD
+Mesh poissonSurface(const PointStore &points)
+{
+	return poissonSurface(convert(points), 4);
+}
+#endif
+
 // experimental function for reconstruction using Radial Basis Functions (too slow, unfortunately)
 Mesh rbfSurface(const Mat points, const Mat normals)
 {
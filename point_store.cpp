@@ -0,0 +1,151 @@
+// point_store.cpp: append-only storage for large point clouds
+
+#include "recon.hpp"
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cassert>
+
+BlockArena::BlockArena(size_t iblockFloats, int iblocksPerSlab)
+{
+	blockFloats = iblockFloats;
+	blocksPerSlab = iblocksPerSlab;
+}
+
+BlockArena::~BlockArena()
+{
+	for (int i=0; i<slabs.size(); i++)
+		free(slabs[i]);
+}
+
+// hand out a free block, allocating a new slab if there is none
+float *BlockArena::allocate()
+{
+	if (freeBlocks.empty()) {
+		float *slab = (float*)malloc(blockFloats * blocksPerSlab * sizeof(float));
+		if (!slab) {
+			fprintf(stderr, "Out of memory for the point cloud, exiting.\n");
+			exit(1);
+		}
+		slabs.push_back(slab);
+		// push in reverse so that blocks are handed out in the order of memory
+		for (int i=blocksPerSlab-1; i>=0; i--)
+			freeBlocks.push_back(slab + i*blockFloats);
+	}
+	float *block = freeBlocks.back();
+	freeBlocks.pop_back();
+	return block;
+}
+
+// return a block so that it can be handed out again
+void BlockArena::release(float *block)
+{
+	freeBlocks.push_back(block);
+}
+
+PointStore::PointStore():arena(columnCount * blockSize, 4)
+{
+	count = 0;
+}
+
+PointStore::~PointStore()
+{
+	// the arena frees all the memory at once
+}
+
+// make room for the given number of points; values of the new points are undefined
+void PointStore::resize(int newCount)
+{
+	int newBlockCount = (newCount + blockSize - 1) / blockSize;
+	while (blocks.size() < newBlockCount)
+		blocks.push_back(arena.allocate());
+	while (blocks.size() > newBlockCount) {
+		arena.release(blocks.back());
+		blocks.pop_back();
+	}
+	count = newCount;
+}
+
+// append a single point: homogeneous position (4 values), normal (3 values) and its density
+void PointStore::append(const float *point, const float *normal, float density)
+{
+	if ((count & blockMask) == 0)
+		blocks.push_back(arena.allocate());
+	float *block = blocks.back();
+	int offset = count & blockMask;
+	block[posX*blockSize + offset] = point[0];
+	block[posY*blockSize + offset] = point[1];
+	block[posZ*blockSize + offset] = point[2];
+	block[posW*blockSize + offset] = point[3];
+	block[normalX*blockSize + offset] = normal[0];
+	block[normalY*blockSize + offset] = normal[1];
+	block[normalZ*blockSize + offset] = normal[2];
+	block[pointDensity*blockSize + offset] = density;
+	count ++;
+}
+
+// append points in rows (x, y, z, w) with normals in rows (nx, ny, nz); density is set to zero
+void PointStore::append(const Mat points, const Mat normals)
+{
+	assert(points.rows == normals.rows);
+	for (int i=0; i<points.rows; i++)
+		append(points.ptr<float>(i), normals.ptr<float>(i), 0.);
+}
+
+// append a copy of all points from another store, column by column
+void PointStore::append(const PointStore &other)
+{
+	int start = count;
+	resize(count + other.count);
+	for (int ob=0; ob<other.blockCount(); ob++) {
+		int length = other.blockLength(ob), done = 0;
+		while (done < length) {
+			// the destination may be split between two blocks
+			int dst = start + ob*blockSize + done;
+			int chunk = IMIN(length - done, blockSize - (dst & blockMask));
+			for (int c=0; c<columnCount; c++)
+				memcpy(column(dst >> blockShift, c) + (dst & blockMask), other.column(ob, c) + done, chunk * sizeof(float));
+			done += chunk;
+		}
+	}
+}
+
+// keep only points with the given indices, in this order
+// expects an ascending sequence, so that the points may be moved in place
+void PointStore::retain(const std::vector<int> &indices, int keepCount)
+{
+	for (int i=0; i<keepCount; i++) {
+		int src = indices[i];
+		assert(src >= i && (i == 0 || src > indices[i-1]));
+		if (src == i)
+			continue;
+		float *dstBlock = blocks[i >> blockShift], *srcBlock = blocks[src >> blockShift];
+		int dstOffset = i & blockMask, srcOffset = src & blockMask;
+		for (int c=0; c<columnCount; c++)
+			dstBlock[c*blockSize + dstOffset] = srcBlock[c*blockSize + srcOffset];
+	}
+	resize(keepCount);
+}
+
+void PointStore::clear()
+{
+	resize(0);
+}
+
+// number of points stored in the given block
+int PointStore::blockLength(int block) const
+{
+	return (block + 1 < blockCount()) ? blockSize : count - block*blockSize;
+}
+
+// copy of the positions, as rows (x, y, z, w)
+Mat PointStore::points() const
+{
+	Mat result(count, 4, CV_32FC1);
+	for (int i=0; i<count; i++) {
+		float *row = result.ptr<float>(i);
+		for (int c=0; c<4; c++)
+			row[c] = at(i, posX + c);
+	}
+	return result;
+}
@@ -0,0 +1,53 @@
+// pyramid.cpp: frames downscaled to all the levels needed by the image comparison
+// so that the pyramid of a main frame is built once instead of once for each of its side views
+
+#include "recon.hpp"
+#include <opencv2/imgproc/imgproc.hpp>
+
+// level 0 is the image converted to float, each next level is half the size until the shorter side gets to 2 px
+FramePyramid::FramePyramid(const Mat iimage):image(iimage)
+{
+	TraceScope trace("buildPyramid");
+	int size = (image.rows < image.cols) ? image.rows : image.cols;
+	Mat level;
+	image.convertTo(level, CV_32FC1);
+	levels.push_back(level);
+	while (size > 2) {
+		Mat down;
+		cv::pyrDown(levels.back(), down);
+		levels.push_back(down);
+		size /= 2;
+	}
+}
+
+PyramidCache::PyramidCache(int icapacity)
+{
+	capacity = icapacity;
+}
+
+// return the pyramid of the given frame, building it from the image if it is not cached
+// the pyramid is built without holding the lock, so that the threads do not wait for each other
+FramePyramid PyramidCache::get(int frameNo, const Mat image)
+{
+	{
+		MonitorLock lock(monitor);
+		for (std::list<Entry>::iterator it = entries.begin(); it != entries.end(); it++) {
+			if (it->first == frameNo) {
+				// mark it as the most recently used one
+				entries.splice(entries.begin(), entries, it);
+				return it->second;
+			}
+		}
+	}
+	FramePyramid pyramid(image);
+	MonitorLock lock(monitor);
+	for (std::list<Entry>::iterator it = entries.begin(); it != entries.end(); it++) {
+		// another thread has been faster
+		if (it->first == frameNo)
+			return it->second;
+	}
+	entries.push_front(Entry(frameNo, pyramid));
+	while (entries.size() > capacity)
+		entries.pop_back();
+	return pyramid;
+}
@@ -6,48 +6,312 @@
 // purely for debugging purposes (when executed with -v or -V)
 #include <stdio.h>
 #include <string.h>
+#include <assert.h>
+#include <map>
 #define logprint(config, level, ...) {if ((config).verbosity >= (level)) printf(__VA_ARGS__);}
 
+// save the main camera's image and depth map for debugging purposes
+void saveMainImages(const Configuration &config, int fa, const Mat originalImage, const Mat depth)
+{
+	char filename[300];
+	snprintf(filename, 300, "frame%i.png", fa);
+	saveImage(originalImage, filename);
+	snprintf(filename, 300, "depth-frame%i.png", fa);
+	saveImage(depth, filename, true);
+}
+
+// calculate the optical flow between the main camera's image and a side view reprojected by our method
+// the pyramid of the main camera's image is shared by all its side views
+Mat trackSide(const Configuration &config, int fa, int fb, const FramePyramid &original, Mat projectedImage, const Mat depth)
+{
+	// calculate the flow 
+	Mat flow = calculateFlow(original, projectedImage, config.useFarneback);
+	if (config.verbosity >= 3) {
+		char filename[300];
+		snprintf(filename, 300, "project-frame%ifrom%i.png", fa, fb);
+		Mat mask;
+		cv::compare(depth, backgroundDepth, mask, cv::CMP_EQ);
+		projectedImage.setTo(0, mask);
+		saveImage(projectedImage, filename);
+		snprintf(filename, 300, "flow-frame%ifrom%i.png", fa, fb);
+		saveImage(flow, filename, true);
+		Mat remapped = flowRemap(flow, projectedImage);
+		snprintf(filename, 300, "frame%ifrom%i-remapped.png", fa, fb);
+		saveImage(remapped, filename);
+		snprintf(filename, 300, "frame%ifrom%i-remap-error.png", fa, fb);
+		saveImage(compare(original, FramePyramid(remapped)), filename, true);
+	}
+	return flow;
+}
+
+// process a single bundle of cameras (main camera, side cameras) with the given render context
+// appends the triangulated points to the given store
+void trackMain(Configuration &config, Render *render, const numberedVector &bundle, PointStore &out)
+{
+	int fa = bundle.first;
+	TraceFrames traceFrames(fa, -1);
+
+	// load main camera's image and calculate its depth map 
+	FramePyramid original = config.pyramid(fa);
+	Mat originalImage = original.image;
+	Mat depth = render->depth(config.camera(fa));
+	if (config.verbosity >= 3)
+		saveMainImages(config, fa, originalImage, depth);
+
+	// calculate optical between the main camera and each side view reprojected by our method
+	MatList flows;
+	for (std::vector<int>::const_iterator it = bundle.second.begin(); it != bundle.second.end(); it++) {
+		// * we now have main camera and a side view * 
+		int fb = *it;
+		TraceFrames traceSideFrames(fa, fb);
+
+		// calculate prediction frame from the side camera 
+		Mat projectedImage = render->projected(config.camera(fa), config.frame(fb), config.camera(fb));
+		projectedImage = mixBackground(projectedImage, originalImage, depth);
+
+		// insert the result so that we can use it in the triangulation part 
+		// note that i-th element of the flows vector corresponds to the i-th side camera
+		flows.push_back(trackSide(config, fa, fb, original, projectedImage, depth));
+	}
+
+	// triangulate all the pixels 
+	triangulatePixels(out, flows, config.cameraTable(), fa, bundle.second, depth);
+}
+
+// write the progress of the reconstruction so that it can be resumed after a crash
+// mesh and finishedMains are only stored in the tracking phase
+void writeCheckpoint(const Configuration &config, const Heuristic &hint, int phase, const Mesh *mesh, const std::vector<int> &finishedMains, uint64_t rngState, PointStore &points)
+{
+	Checkpoint checkpoint;
+	hint.saveState(checkpoint);
+	checkpoint.phase = phase;
+	checkpoint.rngState = rngState;
+	checkpoint.sceneHash = config.sceneHash;
+	checkpoint.frameCount = config.cameraTable().size();
+	checkpoint.width = config.width;
+	checkpoint.height = config.height;
+	checkpoint.finishedMains = finishedMains;
+	if (mesh) {
+		checkpoint.meshVertices = mesh->vertices;
+		checkpoint.meshFaces = mesh->faces;
+	}
+	checkpoint.cloud = &points;
+	if (!saveCheckpoint(config.checkpointFile, checkpoint))
+		fprintf(stderr, "Cannot write checkpoint %s, continuing without it.\n", config.checkpointFile);
+}
+
+// the point cloud being constructed, extended in the order of main cameras
+typedef struct {
+	const Configuration *config;
+	PointStore *points;
+	std::vector<int> finishedMains; // main cameras already appended, in order
+	uint64_t rngState; // state of the random generator when tracking started
+	int savedPoints; // points already in the checkpoint
+} TrackedCloud;
+
+// note that the points of the given main camera are complete, and save the progress if requested
+// only the new points are appended to the checkpoint, the rest of it was written before tracking
+void finishBundle(TrackedCloud &cloud, int fa)
+{
+	cloud.finishedMains.push_back(fa);
+	logprint(*cloud.config, 2, " After processing main frame %i: %i points\n", fa, cloud.points->size());
+	if (cloud.config->checkpointFile) {
+		if (!appendCheckpoint(cloud.config->checkpointFile, fa, *cloud.points, cloud.savedPoints))
+			fprintf(stderr, "Cannot write checkpoint %s, continuing without it.\n", cloud.config->checkpointFile);
+		cloud.savedPoints = cloud.points->size();
+	}
+}
+
+// append points triangulated from the given main camera in a separate store, and release that store
+void appendBundle(TrackedCloud &cloud, int fa, PointStore *triangulated)
+{
+	cloud.points->append(*triangulated);
+	delete triangulated;
+	finishBundle(cloud, fa);
+}
+
+// data shared by the threads tracking main cameras in parallel
+typedef struct {
+	Configuration *config;
+	RenderPool *renders;
+	const Mesh *mesh;
+	const std::vector<numberedVector> *bundles;
+	WorkStealingQueue *queue;
+	std::vector<PointStore*> results; // i-th element holds the points triangulated from the i-th bundle
+	std::vector<bool> finished; // i-th element is set as soon as results[i] is ready
+	Monitor monitor; // guards results and finished
+} TrackingState;
+
+// body of a worker thread: borrow a rendering context and process bundles until none are left
+void trackingWorker(int threadNo, void *arg)
+{
+	TrackingState *state = (TrackingState*)arg;
+	Render *render = state->renders->acquire(*state->mesh);
+	int bundleNo;
+	while ((bundleNo = state->queue->pop(threadNo)) != WorkStealingQueue::empty) {
+		PointStore *triangulated = new PointStore();
+		trackMain(*state->config, render, (*state->bundles)[bundleNo], *triangulated);
+		MonitorLock lock(state->monitor);
+		state->results[bundleNo] = triangulated;
+		state->finished[bundleNo] = true;
+		state->monitor.broadcast();
+	}
+	state->renders->release(render);
+}
+
+// a single (main, side) camera pair travelling through the tracking pipeline
+typedef struct {
+	int bundleNo, sideNo; // position in the list of bundles; sideNo == -1 tells a flow worker to quit
+	FramePyramid original;
+	Mat projectedImage, depth, flow;
+} TrackedPair;
+
+// data shared by the stages of the tracking pipeline
+typedef struct {
+	Configuration *config;
+	const std::vector<numberedVector> *bundles;
+	BoundedQueue<TrackedPair> *projectedQueue, *flowQueue;
+	TrackedCloud *cloud; // written to by the triangulation stage only
+} PipelineState;
+
+// body of an optical flow thread: consume reprojected images and produce flows
+void flowWorker(int threadNo, void *arg)
+{
+	PipelineState *state = (PipelineState*)arg;
+	while (1) {
+		TrackedPair pair = state->projectedQueue->pop();
+		if (pair.sideNo < 0)
+			break;
+		const numberedVector &bundle = (*state->bundles)[pair.bundleNo];
+		TraceFrames traceFrames(bundle.first, bundle.second[pair.sideNo]);
+		pair.flow = trackSide(*state->config, bundle.first, bundle.second[pair.sideNo], pair.original, pair.projectedImage, pair.depth);
+		// the images are not needed anymore, release them as soon as possible
+		pair.original = FramePyramid();
+		pair.projectedImage = Mat();
+		state->flowQueue->push(pair);
+	}
+}
+
+// body of the triangulation thread: collect flows of each bundle, triangulate it when complete
+// and append the results to the point cloud in the order of main cameras
+void triangulationWorker(int threadNo, void *arg)
+{
+	PipelineState *state = (PipelineState*)arg;
+	Configuration &config = *state->config;
+	const std::vector<numberedVector> &bundles = *state->bundles;
+	std::map<int, std::vector<Mat> > flows; // flows received so far for each incomplete bundle
+	std::map<int, int> flowCounts;
+	std::map<int, Mat> depths; // final depth map of each incomplete bundle
+	std::map<int, PointStore*> triangulated; // complete bundles waiting for their predecessors
+	int nextBundle = 0;
+	while (nextBundle < bundles.size()) {
+		TrackedPair pair = state->flowQueue->pop();
+		const numberedVector &bundle = bundles[pair.bundleNo];
+		std::vector<Mat> &bundleFlows = flows[pair.bundleNo];
+		bundleFlows.resize(bundle.second.size());
+		bundleFlows[pair.sideNo] = pair.flow;
+		// the depth map is finished after masking it with the last side camera
+		if (pair.sideNo == bundle.second.size() - 1)
+			depths[pair.bundleNo] = pair.depth;
+		if (++flowCounts[pair.bundleNo] < bundle.second.size())
+			continue;
+
+		// * all side cameras of this bundle are ready *
+		TraceFrames traceFrames(bundle.first, -1);
+		MatList flowList(bundleFlows.begin(), bundleFlows.end());
+		PointStore *points = new PointStore();
+		triangulatePixels(*points, flowList, config.cameraTable(), bundle.first, bundle.second, depths[pair.bundleNo]);
+		triangulated[pair.bundleNo] = points;
+		flows.erase(pair.bundleNo);
+		flowCounts.erase(pair.bundleNo);
+		depths.erase(pair.bundleNo);
+
+		// append all the bundles that are next in order
+		for (std::map<int, PointStore*>::iterator it = triangulated.begin(); it != triangulated.end() && it->first == nextBundle; triangulated.erase(it++), nextBundle++)
+			appendBundle(*state->cloud, bundles[nextBundle].first, it->second);
+	}
+}
+
 // application entry point 
 int main(int argc, char ** argv) {
 	// loads the reconstruction parameters from command-line parameters and the video+calibration from external files 
-	Configuration config = Configuration(argc, argv);
+	Configuration config(argc, argv);
 	logprint(config, 2, " Loaded configuration and video clip\n");
+	if (config.traceFile)
+		startTrace(config.traceFile);
+	// the container needs at least one writer thread
+	if (config.verbosity >= 3 && (config.debugWriters > 0 || config.debugContainer))
+		startDebugSink(IMAX(config.debugWriters, 1), config.debugContainer);
 
 	// initializes heuristic algorithms from the supplied configuration 
 	Heuristic hint(&config);
 
-	// intitialize off-screen rendering (create OpenGL context, ...) 
-	Render *render = spawnRender(hint);
-
-	// store the points from the initial reconstruction 
-	Mat points = config.reconstructedPoints();
-	logprint(config, 2, " Loaded %i points\n", points.rows);
+	// off-screen rendering contexts (OpenGL, ...), created as needed and kept for the whole run
+	RenderPool renders(hint);
 
-	// initialize normals to zero vectors 
-	Mat normals(Mat::zeros(points.rows, 3, CV_32FC1));
+	// store the points from the initial reconstruction, with normals initialized to zero vectors 
+	PointStore points;
+	{
+		Mat reconstructed = config.reconstructedPoints();
+		points.append(reconstructed, Mat::zeros(reconstructed.rows, 3, CV_32FC1));
+	}
+	logprint(config, 2, " Loaded %i points\n", points.size());
+	
+	// continue an interrupted reconstruction if requested
+	Checkpoint checkpoint;
+	bool resumeTracking = false;
+	if (config.resume) {
+		points.clear();
+		checkpoint.cloud = &points;
+		if (!loadCheckpoint(config.checkpointFile, checkpoint)) {
+			fprintf(stderr, "Cannot read checkpoint %s, exiting.\n", config.checkpointFile);
+			exit(1);
+		}
+		// the points and cameras would not match a different scene, clip or frame size
+		if (checkpoint.sceneHash != config.sceneHash || checkpoint.frameCount != config.cameraTable().size() ||
+		    checkpoint.width != config.width || checkpoint.height != config.height) {
+			fprintf(stderr, "Checkpoint %s was saved from a different scene or with different options, exiting.\n", config.checkpointFile);
+			exit(1);
+		}
+		hint.restoreState(checkpoint);
+		cv::theRNG().state = checkpoint.rngState;
+		resumeTracking = (checkpoint.phase == Checkpoint::tracking);
+		logprint(config, 1, "Resuming iteration %i with %i points...\n", checkpoint.iteration, points.size());
+	}
 	
 	// iterate until the heuristic is happy with the precission
 	while (hint.notHappy(points)) {
+		Mesh mesh = Mesh(Mat(), Mat());
+		TrackedCloud cloud;
+		cloud.config = &config;
+		cloud.points = &points;
 
-		// construct polygonized mesh 
-		float alpha;
-		logprint(config, 1, "Meshing...\n");	
-		Mesh mesh = hint.tessellate(points, normals);
-		logprint(config, 2, " %i faces.\n", mesh.faces.rows);
-		if (config.verbosity >= 3)
-			saveMesh(mesh, "recon_orig.obj");
-
-		// feed the mesh into the rendering pipeline 
-		render->loadMesh(mesh);
+		if (resumeTracking) {
+			// the mesh and the cameras had been chosen before the interruption, some main cameras are already done
+			mesh = Mesh(checkpoint.meshVertices, checkpoint.meshFaces);
+			cloud.finishedMains = checkpoint.finishedMains;
+			resumeTracking = false;
+		} else {
+			// construct polygonized mesh 
+			logprint(config, 1, "Meshing...\n");	
+			mesh = hint.tessellate(points);
+			logprint(config, 2, " %i faces.\n", mesh.faces.rows);
+			if (config.verbosity >= 3)
+				saveMesh(mesh, "recon_orig.obj");
 
-		// choose the bundles of cameras with each containing one main camera and some number of side cameras 
-		logprint(config, 1, "Choosing cameras...\n");
-		int cameraCount = hint.chooseCameras(mesh, config.allCameras());
-		if (cameraCount == 0) {
-			printf(" Heuristic has chosen no cameras, which is an error. However, we have got nothing more to do.\n");
-			exit(1);
+			// choose the bundles of cameras with each containing one main camera and some number of side cameras 
+			logprint(config, 1, "Choosing cameras...\n");
+			int cameraCount = hint.chooseCameras(mesh, config.cameraTable());
+			if (cameraCount == 0) {
+				printf(" Heuristic has chosen no cameras, which is an error. However, we have got nothing more to do.\n");
+				exit(1);
+			}
 		}
+		cloud.rngState = cv::theRNG().state;
+		// the mesh, the cameras and the points so far are saved once, each main camera then appends its points
+		if (config.checkpointFile)
+			writeCheckpoint(config, hint, Checkpoint::tracking, &mesh, cloud.finishedMains, cloud.rngState, points);
+		cloud.savedPoints = points.size();
 
 		// print debug information about the selected cameras 
 		if (config.verbosity >= 2) {
@@ -62,81 +326,126 @@ int main(int argc, char ** argv) {
 
 		// construct an improved version of the point cloud 
 		logprint(config, 1, "Tracking the whole clip...\n");
+		std::vector<numberedVector> bundles;
 		for (int fa = hint.beginMain(); fa != Heuristic::sentinel; fa = hint.nextMain()) {
-			// * we now have one main camera with the index fa * 
-
-			// load main camera's image and calculate its depth map 
-			Mat originalImage = config.frame(fa);
-			Mat depth = render->depth(config.camera(fa));
-			if (config.verbosity >= 3) {
-				char filename[300];
-				snprintf(filename, 300, "frame%i.png", fa);
-				saveImage(originalImage, filename);
-				snprintf(filename, 300, "depth-frame%i.png", fa);
-				saveImage(depth, filename, true);
+			bundles.push_back(numberedVector(fa, std::vector<int>()));
+			for (int fb = hint.beginSide(fa); fb != Heuristic::sentinel; fb = hint.nextSide(fa))
+				bundles.back().second.push_back(fb);
+		}
+		// skip the main cameras finished before an interruption
+		assert(cloud.finishedMains.size() <= bundles.size());
+		for (int i=0; i<cloud.finishedMains.size(); i++)
+			assert(bundles[i].first == cloud.finishedMains[i]);
+		bundles.erase(bundles.begin(), bundles.begin() + cloud.finishedMains.size());
+		{
+			// all the tracking modes visit the frames roughly in this order
+			std::vector<int> frameOrder;
+			for (int i=0; i<bundles.size(); i++) {
+				frameOrder.push_back(bundles[i].first);
+				frameOrder.insert(frameOrder.end(), bundles[i].second.begin(), bundles[i].second.end());
 			}
-
-			// calculate optical between the main camera and each side view reprojected by our method
-			MatList flows, cameras;
-			for (int fb = hint.beginSide(fa); fb != Heuristic::sentinel; fb = hint.nextSide(fa)) {
-				// * we now have main camera and a side view * 
-
-				// calculate prediction frame from the side camera 
-				Mat projectedImage = render->projected(config.camera(fa), config.frame(fb), config.camera(fb));
-				projectedImage = mixBackground(projectedImage, originalImage, depth);
-
-				// calculate the flow 
-				Mat flow = calculateFlow(originalImage, projectedImage, config.useFarneback);
-				if (config.verbosity >= 3) {
-					char filename[300];
-					snprintf(filename, 300, "project-frame%ifrom%i.png", fa, fb);
-					Mat mask;
-					cv::compare(depth, backgroundDepth, mask, cv::CMP_EQ);
-					projectedImage.setTo(0, mask);
-					saveImage(projectedImage, filename);
-					snprintf(filename, 300, "flow-frame%ifrom%i.png", fa, fb);
-					saveImage(flow, filename, true);
-					Mat remapped = flowRemap(flow, projectedImage);
-					snprintf(filename, 300, "frame%ifrom%i-remapped.png", fa, fb);
-					saveImage(remapped, filename);
-					snprintf(filename, 300, "frame%ifrom%i-remap-error.png", fa, fb);
-					saveImage(compare(originalImage, remapped), filename, true);
+			config.prefetchFrames(frameOrder);
+		}
+		if (config.pipelineDepth > 0) {
+			// this thread renders, the others calculate optical flow and triangulate
+			BoundedQueue<TrackedPair> projectedQueue(config.pipelineDepth), flowQueue(config.pipelineDepth);
+			PipelineState state;
+			state.config = &config;
+			state.bundles = &bundles;
+			state.projectedQueue = &projectedQueue;
+			state.flowQueue = &flowQueue;
+			state.cloud = &cloud;
+			ThreadGroup flowWorkers, triangulation;
+			flowWorkers.start(config.threadCount, flowWorker, &state);
+			triangulation.start(1, triangulationWorker, &state);
+			Render *render = renders.acquire(mesh);
+			for (int i=0; i<bundles.size(); i++) {
+				int fa = bundles[i].first;
+				TraceFrames traceFrames(fa, -1);
+				assert(bundles[i].second.size() > 0);
+				TrackedPair pair;
+				pair.bundleNo = i;
+				pair.original = config.pyramid(fa);
+				pair.depth = render->depth(config.camera(fa));
+				if (config.verbosity >= 3)
+					saveMainImages(config, fa, pair.original.image, pair.depth);
+				for (pair.sideNo = 0; pair.sideNo < bundles[i].second.size(); pair.sideNo++) {
+					int fb = bundles[i].second[pair.sideNo];
+					TraceFrames traceSideFrames(fa, fb);
+					pair.projectedImage = render->projected(config.camera(fa), config.frame(fb), config.camera(fb));
+					pair.projectedImage = mixBackground(pair.projectedImage, pair.original.image, pair.depth);
+					if (config.verbosity >= 3) {
+						// the debugging output of the flow thread needs the depth map as it is now
+						TrackedPair snapshot = pair;
+						snapshot.depth = pair.depth.clone();
+						projectedQueue.push(snapshot);
+					} else {
+						projectedQueue.push(pair);
+					}
 				}
-				
-				// insert the result so that we can use it in the triangulation part 
-				// note that i-th element of the flows vector corresponds to the i-th element of the cameras vector
-				flows.push_back(flow);
-				cameras.push_back(config.camera(fb)); 
 			}
-
-			// triangulate all the pixels 
-			// note that the resulting matrix contains rows of the form (x, y, z, w, nx, ny, nz)
-			Mat triangData = triangulatePixels(flows, config.camera(fa), cameras, depth);
-			points.push_back(triangData.colRange(0,4));
-			normals.push_back(triangData.colRange(4,7));
-			cameras.push_back(config.camera(fa));
-			logprint(config, 2, " After processing main frame %i: %i points\n", fa, points.rows);
+			TrackedPair quit;
+			quit.sideNo = -1;
+			for (int i=0; i<config.threadCount; i++)
+				projectedQueue.push(quit);
+			renders.release(render);
+			flowWorkers.join();
+			triangulation.join();
+		} else if (config.threadCount <= 1) {
+			Render *render = renders.acquire(mesh);
+			for (int i=0; i<bundles.size(); i++) {
+				// * we now have one main camera with the index bundles[i].first * 
+				trackMain(config, render, bundles[i], points);
+				finishBundle(cloud, bundles[i].first);
+			}
+			renders.release(render);
+		} else {
+			// each worker renders with its own context, the results are merged here in the order of main cameras
+			WorkStealingQueue queue(bundles.size(), config.threadCount);
+			TrackingState state;
+			state.config = &config;
+			state.renders = &renders;
+			state.mesh = &mesh;
+			state.bundles = &bundles;
+			state.queue = &queue;
+			state.results.resize(bundles.size());
+			state.finished.resize(bundles.size(), false);
+			ThreadGroup workers;
+			workers.start(config.threadCount, trackingWorker, &state);
+			for (int i=0; i<bundles.size(); i++) {
+				PointStore *triangulated;
+				{
+					MonitorLock lock(state.monitor);
+					while (!state.finished[i])
+						state.monitor.wait();
+					triangulated = state.results[i];
+					state.results[i] = NULL;
+				}
+				appendBundle(cloud, bundles[i].first, triangulated);
+			}
+			workers.join();
 		}
 		// end of the for cycle going through all main cameras 
 
 		// select a reliable subset of the points  
 		if (config.verbosity >= 3)
-			saveMesh(Mesh(points, Mat()), "purepoints.obj");
-		hint.filterPoints(points, normals);
-		logprint(config, 2, " %i filtered points\n", points.rows);
+			savePoints(points, "purepoints.obj");
+		hint.filterPoints(points);
+		logprint(config, 2, " %i filtered points\n", points.size());
+		if (config.checkpointFile)
+			writeCheckpoint(config, hint, Checkpoint::filtered, NULL, std::vector<int>(), cv::theRNG().state, points);
 	}
 
-	// release resources 
-	delete render;
-
 	// output the polygonized result 
 	if (config.verbosity >= 3)
-		saveMesh(Mesh(points, Mat()), "filteredpoints.obj");
+		savePoints(points, "filteredpoints.obj");
 	logprint(config, 1, "Calculating final mesh...\n");
-	Mesh mesh = hint.tessellate(points, normals);
+	Mesh mesh = hint.tessellate(points);
 	logprint(config, 2, " %i faces\n", mesh.faces.rows);
+	finishDebugSink();
 	saveMesh(mesh, config.outFileName);
 	logprint(config, 2, " Saved, done.\n");
+	finishTrace();
 	return 0;
 }
 
@@ -5,9 +5,14 @@
 #define RECON_HPP
 
 #include <opencv2/core/core.hpp>
+#include <stdint.h>
+#include <pthread.h>
 #include <list>
 #include <vector>
+#include <deque>
 #include <set>
+#include <map>
+#include <string>
 #include <utility>
 
 #define IMIN(a,b) (((a)<(b)) ? (a) : (b))
@@ -24,36 +29,199 @@ typedef struct DensityPoint{
 	DensityPoint(Mat p, float d):point(p), density(d) {};} DensityPoint;
 typedef std::list<Mat> MatList;
 
+namespace cv {class VideoCapture;}
 class Configuration;
 class Heuristic;
+class PointStore;
+class FrameReader;
+class FrameCache;
+class FramePyramid;
+class PyramidCache;
+class Scene;
+class CameraTable;
+class RenderPool;
+class WorkerPool;
+struct Checkpoint;
 
 const float backgroundDepth = 1.0;
 
+// == point_store.cpp ==
+// hands out fixed-size blocks of floats, allocated in large slabs and recycled when released
+class BlockArena {
+	public:
+		BlockArena(size_t blockFloats, int blocksPerSlab);
+		~BlockArena();
+		float *allocate();
+		void release(float *block);
+	protected:
+		size_t blockFloats;
+		int blocksPerSlab;
+		std::vector <float*> slabs, freeBlocks;
+	private:
+		BlockArena(const BlockArena&);
+		BlockArena &operator=(const BlockArena&);
+};
+
+// an append-only point cloud stored in fixed-size blocks, each holding a separate array for every column
+// blocks never move, so appending never copies the points stored so far
+class PointStore {
+	public:
+		enum Column {posX, posY, posZ, posW, normalX, normalY, normalZ, pointDensity, columnCount};
+		static const int blockShift = 16, blockSize = 1 << blockShift, blockMask = blockSize - 1;
+		PointStore();
+		~PointStore();
+		int size() const {return count;};
+		void append(const float *point, const float *normal, float density);
+		void append(const Mat points, const Mat normals);
+		void append(const PointStore &other);
+		void retain(const std::vector<int> &indices, int keepCount);
+		void resize(int newCount);
+		void clear();
+		// random access to a single value
+		float &at(int index, int column) {return blocks[index >> blockShift][column*blockSize + (index & blockMask)];};
+		float at(int index, int column) const {return blocks[index >> blockShift][column*blockSize + (index & blockMask)];};
+		// block-wise access to whole columns
+		int blockCount() const {return blocks.size();};
+		int blockLength(int block) const;
+		float *column(int block, int column) {return blocks[block] + column*blockSize;};
+		const float *column(int block, int column) const {return blocks[block] + column*blockSize;};
+		// a copy in the usual matrix format, for small clouds and debugging
+		Mat points() const;
+	protected:
+		BlockArena arena;
+		std::vector <float*> blocks;
+		int count;
+	private:
+		PointStore(const PointStore&);
+		PointStore &operator=(const PointStore&);
+};
+
 // == alpha_shapes.cpp ==
 Mat alphaShapeFaces(const Mat points);
 Mat alphaShapeFaces(const Mat points, float *alpha); //'alpha' is currently just written to, not used
 
 // == either pcl.cpp or cgal_poisson.cpp ==
-Mesh poissonSurface(const Mat points, const Mat normals);
+Mesh poissonSurface(const PointStore &points);
 
 // == flow.cpp ==
-Mat calculateFlow(const Mat prev, const Mat next, bool useFarneback);
+Mat calculateFlow(const FramePyramid &prev, const Mat next, bool useFarneback);
 
 // == util.cpp ==
 Mat extractCameraCenter(const Mat camera);
-Mat triangulatePixels(const MatList flows, const Mat mainCamera, const MatList cameras, const Mat depth);
-Mat compare(const Mat prev, const Mat next);
+void triangulatePixels(PointStore &cloud, const MatList flows, const CameraTable &table, int mainFrame, const std::vector<int> &sideFrames, const Mat depth);
+Mat compare(const FramePyramid &prev, const FramePyramid &next);
 Mat dehomogenize(Mat points);
 float sampleImage(const Mat image, float radius, const float x, const float y, char c);
 template <class T> T sampleImage(const Mat image, const float x, const float y); // linear sampling
 Mat mixBackground(const Mat image, const Mat background, Mat &depth);
 Mat flowRemap(const Mat flow, const Mat image);
+void validIntegrals(const Mat image, char channel, Mat &sums, Mat &counts);
+float sampleDisk(const Mat sums, const Mat counts, float radiusSquared, const float x, const float y);
 void saveImage(const Mat image, const char *fileName);
 void saveImage(const Mat image, const char *fileName, bool normalize);
+void writeImage(const Mat image, const char *fileName, bool normalize); // always synchronous
 Mesh readMesh(const char *fileName);
 void saveMesh(const Mesh, const char *fileName);
+void writeMesh(const Mesh, const char *fileName); // always synchronous
+void savePoints(const PointStore &points, const char *fileName);
 Mat imageGradient(const Mat image);
 
+// == camera_table.cpp ==
+// results of testing a viewer against the cameras that may see its center; i-th values belong to the camera index[i]
+// the cameras come by leaves of the hierarchy, four at a time; the unused places of a leaf have index -1 and never pass
+typedef struct {
+	std::vector <int> index;
+	std::vector <float> viewX, viewY, viewZ, distance;
+	std::vector <uchar> passed;
+} ViewerTest;
+
+// the cameras of the clip along with their centers and inverses, computed once
+// the frusta (up to the far plane) are bounded by a hierarchy of boxes, to find the cameras seeing a point quickly
+// and the matrix elements of the cameras in each leaf are stored by columns in a packet of four, for batch processing
+class CameraTable {
+	public:
+		CameraTable();
+		void build(const std::vector<Mat> &cameras);
+		int size() const {return count;};
+		const Mat projection(int frameNo) const {return projections[frameNo];};
+		const Mat center(int frameNo) const {return centers[frameNo];}; // homogeneous 4x1, as from extractCameraCenter
+		const Mat inverse(int frameNo) const {return inverses[frameNo];};
+		void camerasNear(const float *point, std::vector<int> &result) const;
+		void testViewer(const Mat viewer, ViewerTest &result) const;
+	protected:
+		typedef struct {
+			float box[6]; // min x, y, z, max x, y, z
+			int begin, end; // range of bvhCameras in the subtree
+			int packet; // the cameras of a leaf; -1 in an inner node
+			int right; // the left child follows its parent; -1 in a leaf
+		} BVHNode;
+		int buildNode(const std::vector<float> &boxes, int begin, int end);
+		void leavesNear(const float *point, std::vector<int> &result) const;
+		int count;
+		std::vector <Mat> projections, centers, inverses;
+		std::vector <BVHNode> bvhNodes;
+		std::vector <int> bvhCameras; // camera indices, ordered so that each node holds a contiguous range
+		// element (row, col) of the projections in the packets is packets[4*row + col], the center is packets[16, ..., 19]
+		// the unused places of a leaf repeat its first camera, packetCameras holds -1 for them
+		std::vector <float> packets[20];
+		std::vector <int> packetCameras;
+};
+
+// == mesh_bvh.cpp ==
+// the faces of a mesh in a bounding volume hierarchy, for testing whether the segment between two points is occluded
+class MeshBVH {
+	public:
+		void build(const Mesh &mesh);
+		bool occluded(const float *from, const float *to) const;
+		void occluded(const float *from, const std::vector<float> &to, std::vector<uchar> &result) const; // many segments from a single point
+	protected:
+		typedef struct {
+			float box[6]; // min x, y, z, max x, y, z
+			int packet; // the faces of a leaf; -1 in an inner node
+			int right; // the left child follows its parent; -1 in a leaf
+		} Node;
+		int buildNode(const std::vector<float> &corners, const std::vector<float> &boxes, std::vector<int> &order, int begin, int end);
+		bool hitsPacket(int packet, const float *from, const float *dir, float tMin) const;
+		std::vector <Node> nodes;
+		std::vector <float> packets[9]; // first vertex x, y, z, first edge x, y, z, second edge x, y, z of each face, four faces per leaf
+};
+
+// == visibility.cpp ==
+// a sparse boolean matrix of tracks (bundles) enabled in frames, stored both by frame and by track
+class Visibility {
+	public:
+		Visibility();
+		void build(const Scene &scene, const std::vector<int> &clipFrames);
+		bool visible(int track, int frame) const; // constant time, using the bitset
+		int frameCount, trackCount;
+		// tracks enabled in frame i are frameTracks[frameStart[i]], ..., frameTracks[frameStart[i+1]-1], in ascending order
+		std::vector <int> frameStart, frameTracks;
+		// frames of track j are trackFrames[trackStart[j]], ..., trackFrames[trackStart[j+1]-1], in ascending order
+		// trackEntries holds the position of the same pair in frameTracks
+		std::vector <int> trackStart, trackFrames, trackEntries;
+	protected:
+		int words; // length of the bitset of each track
+		std::vector <uint64_t> bits;
+};
+
+// == covisibility.cpp ==
+// a graph of cameras sharing enough tracks, weighted by the number of shared tracks and the distance of the camera centers
+// neighbours of camera i are neighbors[start[i]], ..., neighbors[start[i+1]-1], in ascending order, with shared and baseline at the same positions
+class CovisibilityGraph {
+	public:
+		CovisibilityGraph();
+		bool build(const Visibility &visibility, const CameraTable &cameras, WorkerPool &workers, const char *cacheFile); // true if loaded from the cache
+		bool adjacent(int i, int j) const;
+		int edge(int i, int j) const;
+		int degree(int i) const {return start[i+1] - start[i];};
+		int frameCount;
+		std::vector <int32_t> start, neighbors;
+		std::vector <float> shared, baseline;
+	protected:
+		bool load(const char *fileName, uint64_t checksum);
+		void save(const char *fileName, uint64_t checksum) const;
+};
+
 // == configuration.cpp ==
 class Configuration {
 	public:
@@ -61,8 +229,13 @@ class Configuration {
 		~Configuration();
 		Mat reconstructedPoints();
 		const Mat frame(int frameNo) const; // individual frames of the video clip
+		const FramePyramid pyramid(int frameNo) const; // the same frames, prepared for comparison
+		void prefetchFrames(const std::vector<int> &frameNos); // frames that will be needed soon, in order
 		const Mat camera(int frameNo) const; // individual cameras
 		const std::vector<Mat> allCameras() const;
+		const CameraTable &cameraTable() const; // all the cameras, prepared for batch processing
+		const CovisibilityGraph &covisibility() const; // cameras sharing tracks
+		WorkerPool &workerPool() const; // threads running the parallel loops
 		const float near(int frameNo); // near camera values for each frame
 		const float far(int frameNo);
 		const int frameCount();
@@ -70,25 +243,90 @@ class Configuration {
 		char verbosity;
 		bool useFarneback; // switch between optflow algorithms by Farnebaeck and Horn&Schunck
 		float cameraThreshold; // thresholding value for camera selection
+		float coverageTarget; // camera selection stops once its pairs see this fraction of the surface (0 = a fixed number of shots)
 		float sceneResolution; // a parameter to modify the density of the resulting mesh
 		float scalingFactor; // downsample each frame
 		unsigned skipFrames; // skip input frames, for testing
+		float keyframeThreshold; // keep only the frames that differ enough from each other (0 = keep all)
+		float incrementalTolerance; // reuse the camera selection where the mesh moved less than this, relative to its size (0 = select anew)
+		int threadCount; // number of worker threads tracking the main cameras
+		int pipelineDepth; // capacity of the queues between pipelined tracking stages (0 = no pipelining)
+		char *checkpointFile; // filename to save the progress to (NULL = no checkpoints)
+		bool resume; // continue from the checkpoint file
+		char *traceFile; // filename to save the timing of each stage to (NULL = no tracing)
+		int debugWriters; // number of threads saving the debugging output in background (0 = save directly)
+		char *debugContainer; // filename to store all debugging images to as raw floats (NULL = separate image files)
+		size_t frameCacheSize; // memory for decoded frames in bytes (0 = decode the whole clip at once)
+		int decodeThreads; // number of threads decoding the whole clip at once
+		int computeThreads; // number of threads running the parallel loops (of the point filtering, exposure and co-visibility)
+		bool undistort; // remove the lens distortion from the frames when decoding them
 		int width, height;
 		char *outFileName;
 		char *inMeshFile; // filename to read initial mesh from
+		uint64_t sceneHash; // of the YAML file
 	protected:
 		const Mat projectPoints(int frame);
+		std::vector<int> selectKeyframes();
 		void estimateExposure();
-		std::vector <Mat> frames;
+		Mat rawFrame(int frameNo);
+		std::vector <Mat> frames; // all frames, if frameCacheSize == 0
+		FrameReader *reader;
+		FrameCache *frameCache; // NULL if frameCacheSize == 0
+		PyramidCache *pyramids;
+		WorkerPool *workers;
+		Scene *scene; // cameras and bundles may point into its memory
+		Mat exposure; // channel weights (rows) of each frame (columns), if estimated
 		std::vector <Mat> cameras;
+		CameraTable table;
 		std::vector <float> nearVals, farVals;
 		Mat bundles;
-		std::vector< std::set<int> > bundlesEnabled;
+		Visibility visibility; // frames in which each of the bundles is enabled
+		CovisibilityGraph graph;
 		std::vector <float> lensDistortion;
 		float centerX, centerY;
 		bool doEstimateExposure;
 };
 
+// == undistort.cpp ==
+void undistortionMaps(const char *cacheFile, const std::vector<float> &distortion, int width, int height, int sourceWidth, int sourceHeight, float centerX, float centerY, Mat &map1, Mat &map2);
+
+// == scene.cpp ==
+uint64_t hashFile(const char *fileName);
+
+// the scene as described in the YAML file, before applying any command line options
+// frames are numbered from 1 in cameraFrames, as in the YAML file, and from 0 in the enabled frames
+class Scene {
+	public:
+		Scene();
+		~Scene();
+		bool loadYaml(const cv::FileStorage &fs);
+		bool loadCompiled(const char *fileName, uint64_t yamlHash);
+		bool saveCompiled(const char *fileName, uint64_t yamlHash) const;
+		bool enabled(int track, int frame) const;
+		int width, height;
+		float centerX, centerY, fov;
+		std::vector <float> distortion;
+		std::string clipPath; // relative to the YAML file
+		int cameraCount, trackCount;
+		const int32_t *cameraFrames;
+		const float *nearVals, *farVals;
+		const float *projections; // 4x4 matrices, row by row
+		const float *bundles; // homogeneous points
+		int frameWords; // length of each bitset of enabled frames
+		const uint64_t *enabledFrames; // a bitset for each track
+	protected:
+		bool fits(uint64_t offset, uint64_t count, size_t elementSize) const;
+		void *mapping; // the compiled file, if loaded from it
+		size_t mappingSize;
+		// storage of the arrays if parsed from YAML
+		std::vector <int32_t> ownFrames;
+		std::vector <float> ownNear, ownFar, ownProjections, ownBundles;
+		std::vector <uint64_t> ownEnabled;
+	private:
+		Scene(const Scene&);
+		Scene &operator=(const Scene&);
+};
+
 // == render_glx.cpp (or perhaps render_<whatever>.cpp in the future) ==
 class Render {
 	public:
@@ -96,23 +334,64 @@ class Render {
 		virtual void loadMesh(const Mesh) = 0;
 		virtual Mat projected(const Mat camera, const Mat frame, const Mat projector) = 0;
 		virtual Mat depth(const Mat camera) = 0;
+		virtual void makeCurrent() {}; // attach to the calling thread, needed before any other call from a different thread
+		virtual void releaseCurrent() {}; // detach from the calling thread
 };
-Render *spawnRender(Heuristic hint);
+Render *spawnRender(Heuristic hint, Render *share); // with share set, a mesh loaded into either instance is loaded into both
 
 // == heuristic.cpp ==
 typedef std::pair <int, std::vector <int> > numberedVector;
+
+// Structure describing a camera selected by the heuristic
+typedef struct {
+	int index; // actual camera index in the video sequence
+	float cosFromViewer, // cosine of this camera viewed from the given point
+	      distance; // distance of the point to the camera, projected along the camera axis
+	float viewX, viewY; // coordinates as viewed from the given point's camera
+} CameraLabel;
+
+typedef std::vector<CameraLabel> LabelledCameras;
+
+// weights of (main, side) camera pairs in an open addressing hash table, keyed by both frame numbers
+// a pair (i, i) marks that the camera i has been chosen as a main camera
+class PairWeights {
+	public:
+		PairWeights();
+		bool contains(int i, int j) const;
+		float &operator()(int i, int j); // inserts a zero weight if not present
+		float get(int i, int j) const; // zero if not present
+		size_t slotCount() const {return keys.size();};
+		bool entry(size_t slot, int &i, int &j, float &weight) const; // the pair in the given slot, false if it is empty
+	protected:
+		static const uint64_t emptyKey = ~(uint64_t)0;
+		static uint64_t key(int i, int j) {return ((uint64_t)(uint32_t)i << 32) | (uint32_t)j;};
+		size_t slot(uint64_t key) const;
+		std::vector<uint64_t> keys;
+		std::vector<float> values;
+		size_t count;
+};
+
+// a shot of the camera selection, kept for the next iteration with --incremental
+typedef struct {
+	float point[3], normal[3]; // the point on the surface the shot was taken from
+	LabelledCameras filtered; // the cameras that may see that point, not tested for obstacles
+	std::vector <std::pair <int, int> > pairs; // the (main, side) pairs chosen from this shot
+} CachedShot;
+
 class Heuristic {
 	public:
 		Heuristic(Configuration *iconfig);
-		int chooseCameras(const Mesh mesh, const std::vector<Mat> cameras);
-		bool notHappy(const Mat points);
+		int chooseCameras(const Mesh mesh, const CameraTable &cameras);
+		bool notHappy(const PointStore &points);
 		int beginMain(); // initialize and return frame number for the first main camera
 		int nextMain(); // return frame number for the next main camera
 		int beginSide(int mainNumber); // initialize and return frame number for the first side camera
 		int nextSide(int mainNumber); // return frame number for the next side camera
-		void filterPoints(Mat& points, Mat& normals);
-		Mesh tessellate(const Mat points, const Mat normals);
+		void filterPoints(PointStore &points);
+		Mesh tessellate(const PointStore &points);
 		cv::Size renderSize();
+		void saveState(Checkpoint &checkpoint) const; // store iteration, alpha values and chosen cameras
+		void restoreState(const Checkpoint &checkpoint);
 		static const int sentinel = -1;
 	protected:
 		Configuration *config;
@@ -120,5 +399,267 @@ class Heuristic {
 		int mainIdx, sideIdx;
 		std::vector <numberedVector> chosenCameras;
 		std::vector <float> alphaVals;
+		std::vector <CachedShot> shotCache; // the shots of the last camera selection, with --incremental
+		PairWeights pairWeights; // the pair weights of the last camera selection, with --incremental
+};
+
+// == checkpoint.cpp ==
+// everything needed to continue an interrupted reconstruction
+typedef struct Checkpoint {
+	enum Phase {tracking = 0, filtered = 1}; // saved before tracking (and extended after each main camera) / after filtering the points
+	int32_t iteration, phase;
+	uint64_t rngState;
+	std::vector <float> alphaVals;
+	std::vector <numberedVector> chosenCameras;
+	std::vector <CachedShot> shotCache; // with --incremental
+	PairWeights pairWeights;
+	uint64_t sceneHash; // of the YAML file; a checkpoint of a different scene is refused
+	int32_t frameCount, width, height; // of the clip after applying the options, checked as well
+	std::vector <int> finishedMains; // main cameras whose points are already included (tracking phase only)
+	Mat meshVertices, meshFaces; // the mesh being tracked (tracking phase only)
+	PointStore *cloud; // not owned; loadCheckpoint appends to it
+} Checkpoint;
+bool saveCheckpoint(const char *fileName, const Checkpoint &checkpoint);
+bool appendCheckpoint(const char *fileName, int mainCamera, const PointStore &cloud, int begin);
+bool loadCheckpoint(const char *fileName, Checkpoint &checkpoint);
+
+// == trace.cpp ==
+extern bool traceEnabled;
+double traceClock();
+void startTrace(const char *fileName);
+void finishTrace();
+void traceEvent(const char *name, double start);
+void setTraceFrames(int mainFrame, int sideFrame); // -1 means no frame
+void getTraceFrames(int *mainFrame, int *sideFrame);
+
+// measures the time until the end of the enclosing block; costs a single branch if tracing is disabled
+class TraceScope {
+	public:
+		TraceScope(const char *iname):name(iname) {if (traceEnabled) start = traceClock();};
+		~TraceScope() {if (traceEnabled) traceEvent(name, start);};
+	protected:
+		const char *name;
+		double start;
+};
+
+// marks the frames processed by the current thread until the end of the enclosing block
+class TraceFrames {
+	public:
+		TraceFrames(int mainFrame, int sideFrame) {getTraceFrames(&oldMain, &oldSide); setTraceFrames(mainFrame, sideFrame);};
+		~TraceFrames() {setTraceFrames(oldMain, oldSide);};
+	protected:
+		int oldMain, oldSide;
+};
+
+// == debug_sink.cpp ==
+void startDebugSink(int threadCount, const char *containerFile);
+void finishDebugSink();
+bool queueDebugImage(const Mat image, const char *fileName, bool normalize); // false if the sink is not running
+bool queueDebugMesh(const Mesh mesh, const char *fileName);
+bool queueDebugPoints(const PointStore &points, const char *fileName); // saved as the vertices of a mesh
+
+// == parallel.cpp ==
+// a mutex together with a condition variable, for threads waiting on each other's results
+class Monitor {
+	public:
+		Monitor();
+		~Monitor();
+		void lock();
+		void unlock();
+		void wait(); // expects the monitor to be locked
+		void broadcast();
+	protected:
+		pthread_mutex_t mutex;
+		pthread_cond_t condition;
+};
+
+// locks the given monitor for the lifetime of this object
+class MonitorLock {
+	public:
+		MonitorLock(Monitor &imonitor):monitor(imonitor) {monitor.lock();};
+		~MonitorLock() {monitor.unlock();};
+	protected:
+		Monitor &monitor;
+};
+
+// a fixed number of threads, each running the same function
+class ThreadGroup {
+	public:
+		typedef void (*Function)(int threadNo, void *arg);
+		void start(int threadCount, Function function, void *arg);
+		void join();
+	protected:
+		typedef struct {Function function; void *arg; int threadNo;} Task;
+		static void *run(void *task);
+		std::vector <pthread_t> threads;
+		std::vector <Task> tasks;
+};
+
+typedef void (*RangeFunction)(int begin, int end, void *arg);
+
+// threads started once and kept waiting for parallel loops, so that a loop does not pay for starting them
+// the thread calling parallelFor works too, together with threadCount-1 helpers; one loop at a time
+class WorkerPool {
+	public:
+		WorkerPool(int threadCount);
+		~WorkerPool();
+		int size() const {return threadCount;};
+		void parallelFor(int count, int chunkSize, RangeFunction body, void *arg);
+	protected:
+		static void helper(int threadNo, void *arg);
+		void runChunks();
+		int threadCount;
+		ThreadGroup helpers;
+		Monitor monitor; // guards all of the following
+		int generation; // number of loops started
+		int working; // helpers not done with the current loop yet
+		bool stopping;
+		int count, chunkSize, nextChunk;
+		RangeFunction body;
+		void *arg;
+	private:
+		WorkerPool(const WorkerPool&);
+		WorkerPool &operator=(const WorkerPool&);
+};
+
+// a FIFO queue of limited capacity: push() waits while it is full, pop() waits while it is empty
+template <class T>
+class BoundedQueue {
+	public:
+		BoundedQueue(int icapacity):capacity(icapacity) {};
+		void push(const T &item) {
+			MonitorLock lock(monitor);
+			while (items.size() >= capacity)
+				monitor.wait();
+			items.push_back(item);
+			monitor.broadcast();
+		};
+		T pop() {
+			MonitorLock lock(monitor);
+			while (items.empty())
+				monitor.wait();
+			T item = items.front();
+			items.pop_front();
+			monitor.broadcast();
+			return item;
+		};
+	protected:
+		unsigned capacity;
+		std::deque<T> items;
+		Monitor monitor;
+};
+
+// task indices dealt among a number of workers; a worker with nothing left to do steals from the others
+class WorkStealingQueue {
+	public:
+		WorkStealingQueue(int taskCount, int workerCount);
+		~WorkStealingQueue();
+		int pop(int workerNo); // returns a task index or WorkStealingQueue::empty
+		static const int empty = -1;
+	protected:
+		int workerCount;
+		std::vector< std::deque<int> > tasks;
+		Monitor *locks;
+};
+
+// == render_pool.cpp ==
+// rendering contexts lent to threads, all sharing the last mesh loaded
+class RenderPool {
+	public:
+		RenderPool(const Heuristic &hint);
+		~RenderPool(); // must be called with no context borrowed
+		Render *acquire(const Mesh mesh); // a context made current in the calling thread, with the given mesh loaded
+		void release(Render *render);
+	protected:
+		typedef struct {Render *render; bool busy;} PooledRender;
+		void load(Render *render, const Mesh mesh); // unless the contexts already have the mesh
+		Heuristic hint; // passed to spawnRender
+		std::vector <PooledRender> renders; // the first one is shared by all the others
+		Mat vertices, faces; // the mesh loaded into the contexts
+		Monitor monitor; // guards all of the above
+};
+
+// == pyramid.cpp ==
+// a frame along with its float versions downscaled by half on each level, immutable once built
+class FramePyramid {
+	public:
+		FramePyramid() {};
+		explicit FramePyramid(const Mat image);
+		Mat image; // as given, used by the optical flow
+		std::vector <Mat> levels; // level 0 at full size
+};
+
+// pyramids of the most recently used frames
+class PyramidCache {
+	public:
+		PyramidCache(int capacity);
+		FramePyramid get(int frameNo, const Mat image);
+	protected:
+		typedef std::pair<int, FramePyramid> Entry;
+		unsigned capacity;
+		std::list<Entry> entries; // most recently used first
+		Monitor monitor; // guards entries
+};
+
+// == frame_cache.cpp ==
+Mat normalizeFrame(const Mat raw, const Mat exposure, int frameNo); // convert to grayscale, applying the exposure if not empty
+
+// decodes individual frames of a video or an image sequence, scaled to the given size
+class FrameReader {
+	public:
+		FrameReader(const std::string &path, int width, int height);
+		void setFrames(const std::vector<int> &clipFrames);
+		~FrameReader();
+		bool isOpened();
+		int clipLength();
+		void setUndistortion(const Mat map1, const Mat map2, int sourceWidth, int sourceHeight);
+		Mat read(int frameNo); // frameNo indexes the frames given to setFrames
+		void readAll(std::vector<Mat> &frames, int threadCount);
+	protected:
+		static const int maxGrabs = 32; // skip at most this many frames of a video without seeking
+		std::string path;
+		cv::VideoCapture *clip; // NULL for an image sequence
+		std::vector<std::string> files; // image sequence, one file per frame
+		int width, height;
+		std::vector<int> clipFrames; // number of each tracked frame in the clip, counted from 0
+		int position; // number of the next frame in the video
+		Mat map1, map2; // undistortion table, empty if not used
+		int sourceWidth, sourceHeight; // frame size expected by the table
+		Monitor monitor; // guards clip and position
+	private:
+		FrameReader(const FrameReader&);
+		FrameReader &operator=(const FrameReader&);
+};
+
+// the most recently used frames, decoded on demand and prefetched in background
+class FrameCache {
+	public:
+		FrameCache(FrameReader *reader, const Mat exposure, size_t budget);
+		~FrameCache();
+		Mat get(int frameNo);
+		void prefetch(const std::vector<int> &frameNos);
+	protected:
+		typedef struct {
+			Mat image;
+			std::list<int>::iterator position; // in the lru list
+			bool ready; // false while being decoded
+			bool prefetched; // decoded in advance and not used yet
+		} Entry;
+		Mat decode(int frameNo, bool prefetched);
+		void evict();
+		static void prefetchWorker(int threadNo, void *arg);
+		FrameReader *reader;
+		Mat exposure;
+		size_t budget, usedBytes, prefetchedBytes;
+		std::map<int, Entry> entries;
+		std::list<int> lru; // most recently used first
+		std::vector<int> prefetchList;
+		int prefetchIndex;
+		bool quitting;
+		Monitor monitor; // guards everything above
+		ThreadGroup prefetcher;
+	private:
+		FrameCache(const FrameCache&);
+		FrameCache &operator=(const FrameCache&);
 };
 #endif
@@ -4,6 +4,7 @@
 #include <X11/Xutil.h>
 #include <GL/glew.h>
 #include <GL/glx.h>
+#include <pthread.h>
 
 //sets the variables vertexShaderSources, fragmentShaderSources
 #include "shaders.hpp"
@@ -24,6 +25,7 @@
 	typedef struct Mesh{
 		Mat vertices, faces;
 		Mesh(Mat v, Mat f):vertices(v), faces(f) {};} Mesh;
+	class TraceScope {public: TraceScope(const char *name) {};};
 #else
 	#include "recon.hpp"
 #endif
@@ -36,27 +38,29 @@ class RenderGLX;
 
 class RenderGLX: public Render {
 	public:
-		RenderGLX(int width, int height, char *displayName);
+		RenderGLX(int width, int height, char *displayName, RenderGLX *share);
 		~RenderGLX();
 		virtual void loadMesh(const Mesh mesh);
 		virtual Mat projected(const Mat camera, const Mat frame, const Mat projector);
 		virtual Mat depth(const Mat camera);
+		virtual void makeCurrent();
+		virtual void releaseCurrent();
 	protected:
-		static int instanceCount;
 		GLuint programID, mainMatrixID, sideMatrixID, textureSamplerID, shadowSamplerID, vertexbuffer, vertexArrayID, imgw, imgh;
+		RenderGLX *owner; // the instance holding the display and the vertex buffer, shared by all the instances created from it
 		Display *display;
 		GLXContext context;
 		GLXPbuffer glxbuffer;
 		int vertex_count;
 };
-// To solve some uncomfortable interference, some resources are freed just at the end of the program
-int RenderGLX::instanceCount = 0;
+// Render instances may be created by several threads at once
+pthread_mutex_t instanceLock = PTHREAD_MUTEX_INITIALIZER;
 
 // A generic function to create a Render instance; if this cpp file is used, it will be a RenderGLX instance
-Render *spawnRender(Heuristic hint)
+Render *spawnRender(Heuristic hint, Render *share)
 {
 	cv::Size size = hint.renderSize();
-	RenderGLX *render = new RenderGLX(size.width, size.height, getenv("DISPLAY"));
+	RenderGLX *render = new RenderGLX(size.width, size.height, getenv("DISPLAY"), (RenderGLX*)share);
 	return render;
 }
 
@@ -148,9 +152,17 @@ GLuint LoadShaders(){
 }
 
 // Initialize all system resources necessary for rendering (program crashes if this is unsuccessful)
-RenderGLX::RenderGLX(int width, int height, char *displayName)
+// with share set, the new context uses its display and shares its objects, so that a mesh is uploaded only once
+RenderGLX::RenderGLX(int width, int height, char *displayName, RenderGLX *share)
 {
-	instanceCount += 1;
+	pthread_mutex_lock(&instanceLock);
+	// Xlib has to know about multiple threads before it is used for the first time
+	static bool threadsInitialized = false;
+	if (!threadsInitialized) {
+		XInitThreads();
+		threadsInitialized = true;
+	}
+	pthread_mutex_unlock(&instanceLock);
 	
 	vertexbuffer = -1;
 	vertex_count = 0;
@@ -158,8 +170,13 @@ RenderGLX::RenderGLX(int width, int height, char *displayName)
 	imgw = width;
 	imgh = height;
 	_Xdebug = 1;
-	display = XOpenDisplay(displayName);
-	XSynchronize(display, 0);
+	owner = share ? share->owner : this;
+	if (owner == this) {
+		display = XOpenDisplay(displayName);
+		XSynchronize(display, 0);
+	} else {
+		display = owner->display;
+	}
 
 	// Get a glX 'visual' structure on the default screen
 	// NOTE: for some reason, my system has only a RGBA Visual and only a RGB FrameBuffer. Some systems may require to remove the GLX_RGBA flag
@@ -183,7 +200,7 @@ RenderGLX::RenderGLX(int width, int height, char *displayName)
 	// Secondly, we use the basic context to get a more advanced (3.0) one
  	GLXCREATECONTEXTATTRIBSARBPROC glXCreateContextAttribsARB = (GLXCREATECONTEXTATTRIBSARBPROC) glXGetProcAddress((const GLubyte*)"glXCreateContextAttribsARB");
 	int ctxattribs[] = {GLX_CONTEXT_MAJOR_VERSION_ARB, 3, GLX_CONTEXT_MINOR_VERSION_ARB, 0, GLX_CONTEXT_PROFILE_MASK_ARB, GLX_CONTEXT_CORE_PROFILE_BIT_ARB, 0};
-	context = glXCreateContextAttribsARB(display, *fbconfig, 0, GL_TRUE, ctxattribs);
+	context = glXCreateContextAttribsARB(display, *fbconfig, (owner == this) ? 0 : owner->context, GL_TRUE, ctxattribs);
 	glXMakeCurrent(display, glxbuffer, context);
 	glXDestroyContext(display, oldContext);
 	
@@ -206,33 +223,44 @@ RenderGLX::RenderGLX(int width, int height, char *displayName)
 	glGenVertexArrays(1, &vertexArrayID);
 }
 
+// the context has to be current in the calling thread; the instances sharing it have to be destroyed before the owner
 RenderGLX::~RenderGLX()
 {
-	instanceCount -= 1;
-	
-	// these buffers seem to interfere, may be caused by some optimization
-	if (vertexbuffer != -1 && instanceCount == 0)
+	// each instance frees everything it created, the shared buffer and display belong to the owner
+	if (owner == this && vertexbuffer != -1)
 		glDeleteBuffers(1, &vertexbuffer);
 
 	// Deallocate resources
 	glDeleteProgram(programID);
 	glDeleteVertexArrays(1, &vertexArrayID);
+	glXMakeCurrent(display, None, NULL);
 	glXDestroyContext(display, context);
 	glXDestroyPbuffer(display, glxbuffer);
-
-	// Display is closed only at the end of the program
-	if (instanceCount == 0)
+	if (owner == this)
 		XCloseDisplay(display);
 }
 
+// a GLX context can be current in just one thread at a time
+void RenderGLX::makeCurrent()
+{
+	glXMakeCurrent(display, glxbuffer, context);
+}
+
+void RenderGLX::releaseCurrent()
+{
+	glXMakeCurrent(display, None, NULL);
+}
+
 // loads given Mesh structure into the OpenGL Vertex Buffer Object for rendering
+// the buffer is shared, so the mesh is loaded for all the instances created from the same owner
 void RenderGLX::loadMesh(const Mesh mesh) {
+	TraceScope trace("loadMesh");
 	assert (mesh.vertices.isContinuous() && mesh.faces.isContinuous());
 
 	// the structure is just a list of triplets of vertices, each denoting a single face
 	// vertices are repeated as necessary
 	int face_count = mesh.faces.rows;
-	vertex_count = face_count*3;
+	int vertex_count = face_count*3;
 	GLfloat *vertex_buffer_data = new GLfloat[3*vertex_count];
 	for (int i=0; i < face_count; i++) {
 		const int32_t *face = mesh.faces.ptr<int32_t>(i);
@@ -246,26 +274,30 @@ void RenderGLX::loadMesh(const Mesh mesh) {
 	
 	// Set this vertex buffer to be used during rendering
 	glBindVertexArray(vertexArrayID);
-	if (vertexbuffer != -1)
-		glDeleteBuffers(1, &vertexbuffer);
-	glGenBuffers(1, &vertexbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
+	if (owner->vertexbuffer != -1)
+		glDeleteBuffers(1, &owner->vertexbuffer);
+	glGenBuffers(1, &owner->vertexbuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, owner->vertexbuffer);
 	
 	// Load the vertex positions into the GPU memory
 	glBufferData(GL_ARRAY_BUFFER, 3*vertex_count*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW);
 	delete vertex_buffer_data;
+	owner->vertex_count = vertex_count;
+	// the other contexts may only use the buffer once it is complete
+	glFinish();
 }
 
 // Renders the (previously loaded) scene from the given (main) camera, with frame being projected from projector (aka. side camera)
 Mat RenderGLX::projected(const Mat camera, const Mat frame, const Mat projector)
 {
+	TraceScope trace("projected");
 	glUseProgram(programID);
 
 	glUniformMatrix4fv(mainMatrixID, 1, GL_TRUE, (float*)projector.data);
 	glUniformMatrix4fv(sideMatrixID, 1, GL_TRUE, (float*)projector.data);
 
 	glEnableVertexAttribArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, owner->vertexbuffer);
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
 
 	// == BEGIN generate a shadow map ==
@@ -276,7 +308,7 @@ Mat RenderGLX::projected(const Mat camera, const Mat frame, const Mat projector)
 		
 		// Render the scene without setting any texture or projector
 		glViewport(0, 0, imgw, imgh);
-		glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+		glDrawArrays(GL_TRIANGLES, 0, owner->vertex_count);
 		
 		glDisableVertexAttribArray(0);
 		glDisableVertexAttribArray(1);
@@ -329,7 +361,7 @@ Mat RenderGLX::projected(const Mat camera, const Mat frame, const Mat projector)
 
 	// again, set all necessary scene parameters
 	glEnableVertexAttribArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, owner->vertexbuffer);
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -346,7 +378,7 @@ Mat RenderGLX::projected(const Mat camera, const Mat frame, const Mat projector)
 
 	// Render the scene
 	glViewport(0, 0, imgw, imgh);
-	glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+	glDrawArrays(GL_TRIANGLES, 0, owner->vertex_count);
 
 	glDisableVertexAttribArray(0);
 	glDisableVertexAttribArray(1);
@@ -366,6 +398,7 @@ Mat RenderGLX::projected(const Mat camera, const Mat frame, const Mat projector)
 }	
 
 Mat RenderGLX::depth(const Mat camera) {
+	TraceScope trace("depth");
 	glClear(GL_DEPTH_BUFFER_BIT);
 
 	// render without using any texture nor projector
@@ -374,12 +407,12 @@ Mat RenderGLX::depth(const Mat camera) {
 	glUniformMatrix4fv(mainMatrixID, 1, GL_TRUE, (float*)camera.data);
 
 	glEnableVertexAttribArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, owner->vertexbuffer);
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
 
 	// render the scene
 	glViewport(0, 0, imgw, imgh);
-	glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+	glDrawArrays(GL_TRIANGLES, 0, owner->vertex_count);
 
 	glDisableVertexAttribArray(0);
 	glDisableVertexAttribArray(1);
@@ -401,7 +434,7 @@ Mat RenderGLX::depth(const Mat camera) {
 // If this function does not run, this code is incompatible with your system
 int main(int argc, char ** argv)
 {
-	RenderGLX r = RenderGLX(640, 480, (char*)":0");
+	RenderGLX r = RenderGLX(640, 480, (char*)":0", NULL);
 
 Mat points = (cv::Mat_<float>(25.0, 4) << 0.5127, -3.9222, -29.4300, 1.0000, 0.6195, -0.2643, -27.4378, 1.0000, 4.5767, 0.2684, -28.6282, 1.0000, 4.4699, -3.3895, -30.6204, 1.0000, 1.8125, -5.8448, -25.9695, 1.0000, 1.9193, -2.1869, -23.9774, 1.0000, 5.8765, -1.6541, -25.1678, 1.0000, -3.7263, 1.9956, -20.7352, 1.0000, -5.1135, -5.5956, -28.2388, 1.0000, -5.0067, -1.9377, -26.2467, 1.0000, -1.0495, -1.4050, -27.4371, 1.0000, -1.1563, -5.0629, -29.4292, 1.0000, -3.8137, -7.5182, -24.7784, 1.0000, 0.2503, -3.3276, -23.9766, 1.0000, 0.1435, -6.9855, -25.9688, 1.0000, -4.5209, -0.3826, -22.9609, 1.0000, -4.4455, 2.1991, -21.5549, 1.0000, -1.6526, 2.5750, -22.3950, 1.0000, -1.7281, -0.0066, -23.8010, 1.0000, -3.6036, -1.7395, -20.5186, 1.0000, -3.5282, 0.8422, -19.1126, 1.0000, -0.7353, 1.2181, -19.9528, 1.0000, -0.8107, -1.3635, -21.3588, 1.0000, -3.3029, 1.3693, -19.6080, 1.0000, -2.0139, 1.5429, -19.9957, 1.0000);
 Mat indices = (cv::Mat_<int32_t>(27.0, 3) << 4, 5, 1, 5, 6, 1, 0, 1, 2, 13, 14, 11, 14, 12, 8, 8, 9, 10, 19, 20, 16, 20, 21, 16, 21, 22, 17, 22, 19, 18, 15, 16, 17, 22, 21, 20, 0, 4, 1, 21, 17, 16, 13, 10, 9, 3, 0, 2, 8, 12, 9, 22, 18, 17, 10, 13, 11, 11, 14, 8, 11, 8, 10, 15, 19, 16, 23, 24, 7, 6, 2, 1, 18, 15, 17, 19, 22, 20, 19, 15, 18);
@@ -0,0 +1,68 @@
+// render_pool.cpp: rendering contexts kept alive for the whole run and lent to the threads that need them
+// creating a context is expensive, and so is uploading a mesh; all the contexts share the first one, so each mesh is uploaded once
+
+#include "recon.hpp"
+
+RenderPool::RenderPool(const Heuristic &ihint):hint(ihint)
+{
+}
+
+// contexts are destroyed in this thread, each has to be made current here first
+// the first context is shared by the others, so it goes last
+RenderPool::~RenderPool()
+{
+	for (int i=renders.size()-1; i>=0; i--) {
+		renders[i].render->makeCurrent();
+		delete renders[i].render;
+	}
+}
+
+// borrow a context, made current in the calling thread, and make sure it has the given mesh
+Render *RenderPool::acquire(const Mesh mesh)
+{
+	MonitorLock lock(monitor);
+	Render *render = NULL;
+	for (int i=0; i<renders.size() && !render; i++) {
+		if (!renders[i].busy) {
+			renders[i].busy = true;
+			render = renders[i].render;
+		}
+	}
+	if (!render) {
+		// a new context is current in the thread that created it
+		// it is created while holding the lock, so that there is only one first context
+		PooledRender pooled;
+		pooled.render = render = spawnRender(hint, renders.empty() ? NULL : renders[0].render);
+		pooled.busy = true;
+		renders.push_back(pooled);
+	} else {
+		render->makeCurrent();
+	}
+	// the other threads wait for the upload instead of repeating it
+	load(render, mesh);
+	return render;
+}
+
+// load the mesh into a borrowed context, unless the contexts already have it
+// meshes are never modified in place, so the same data means the same mesh
+void RenderPool::load(Render *render, const Mesh mesh)
+{
+	if (vertices.data == mesh.vertices.data && faces.data == mesh.faces.data &&
+	    vertices.rows == mesh.vertices.rows && faces.rows == mesh.faces.rows)
+		return;
+	render->loadMesh(mesh);
+	// keeping the matrices referenced makes sure that their memory is not reused by another mesh
+	vertices = mesh.vertices;
+	faces = mesh.faces;
+}
+
+// return a borrowed context to the pool, detaching it from the calling thread
+void RenderPool::release(Render *render)
+{
+	render->releaseCurrent();
+	MonitorLock lock(monitor);
+	for (int i=0; i<renders.size(); i++) {
+		if (renders[i].render == render)
+			renders[i].busy = false;
+	}
+}
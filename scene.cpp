@@ -0,0 +1,251 @@
+// scene.cpp: the scene description (clip properties, cameras and tracks) as exported from Blender
+// parsed from YAML, or mapped from a compiled binary file which is much faster to load
+
+#include "recon.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// the compiled file starts with this header, followed by the arrays at the given offsets (each aligned to 8 bytes)
+const char sceneMagic[8] = {'R','E','C','O','N','S','C','N'};
+const int32_t sceneVersion = 1;
+typedef struct {
+	char magic[8];
+	int32_t version, width, height;
+	float centerX, centerY, fov;
+	uint64_t yamlHash; // of the YAML file the scene was compiled from
+	int32_t pathLength, distortionCount, cameraCount, trackCount, frameWords, padding;
+	uint64_t pathOffset, distortionOffset, cameraFramesOffset, nearOffset, farOffset, projectionsOffset, bundlesOffset, enabledOffset;
+} SceneHeader;
+
+// FNV-1a hash of the whole file, or 0 if it cannot be read
+uint64_t hashFile(const char *fileName)
+{
+	FILE *file = fopen(fileName, "rb");
+	if (!file)
+		return 0;
+	uint64_t hash = 14695981039346656037ULL;
+	unsigned char buffer[65536];
+	size_t length;
+	while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		for (size_t i=0; i<length; i++) {
+			hash ^= buffer[i];
+			hash *= 1099511628211ULL;
+		}
+	}
+	fclose(file);
+	return hash;
+}
+
+Scene::Scene()
+{
+	mapping = NULL;
+	mappingSize = 0;
+	width = height = 0;
+	centerX = centerY = fov = 0;
+	cameraCount = trackCount = frameWords = 0;
+	cameraFrames = NULL;
+	nearVals = farVals = projections = bundles = NULL;
+	enabledFrames = NULL;
+}
+
+Scene::~Scene()
+{
+	if (mapping)
+		munmap(mapping, mappingSize);
+}
+
+// parse the scene from an opened YAML file
+bool Scene::loadYaml(const cv::FileStorage &fs)
+{
+	cv::FileNode nodeClip = fs["clip"];
+	nodeClip["width"] >> width;
+	nodeClip["height"] >> height;
+	nodeClip["path"] >> clipPath;
+	nodeClip["center-x"] >> centerX;
+	nodeClip["center-y"] >> centerY;
+	nodeClip["fov"] >> fov;
+	nodeClip["distortion"] >> distortion;
+
+	cv::FileNode camera = fs["camera"];
+	for (cv::FileNodeIterator cit = camera.begin(); cit != camera.end(); cit ++) {
+		int fi;
+		float near, far;
+		Mat projection;
+		(*cit)["frame"] >> fi;
+		(*cit)["near"] >> near;
+		(*cit)["far"] >> far;
+		(*cit)["projection"] >> projection;
+		if (projection.rows != 4 || projection.cols != 4)
+			return false;
+		projection.convertTo(projection, CV_32FC1);
+		ownFrames.push_back(fi);
+		ownNear.push_back(near);
+		ownFar.push_back(far);
+		for (int i=0; i<4; i++)
+			ownProjections.insert(ownProjections.end(), projection.ptr<float>(i), projection.ptr<float>(i) + 4);
+	}
+
+	// collect the enabled frames first, to know the size of each bitset
+	cv::FileNode tracks = fs["tracks"];
+	std::vector< std::vector<int> > enabled;
+	int maxFrame = 1;
+	for (cv::FileNodeIterator it = tracks.begin(); it != tracks.end(); it++) {
+		Mat bundle;
+		(*it)["bundle"] >> bundle;
+		if (bundle.total() != 4)
+			return false;
+		bundle.convertTo(bundle, CV_32FC1);
+		bundle = bundle.reshape(1, 1);
+		ownBundles.insert(ownBundles.end(), bundle.ptr<float>(0), bundle.ptr<float>(0) + 4);
+		enabled.push_back(std::vector<int>());
+		(*it)["frames-enabled"] >> enabled.back();
+		for (int i=0; i<enabled.back().size(); i++)
+			maxFrame = IMAX(maxFrame, enabled.back()[i]);
+	}
+	frameWords = (maxFrame + 63) / 64;
+	ownEnabled.assign(enabled.size() * frameWords, 0);
+	for (int j=0; j<enabled.size(); j++) {
+		for (int i=0; i<enabled[j].size(); i++) {
+			int bit = enabled[j][i] - 1;
+			if (bit >= 0)
+				ownEnabled[j*frameWords + bit/64] |= (uint64_t)1 << (bit%64);
+		}
+	}
+
+	cameraCount = ownFrames.size();
+	trackCount = enabled.size();
+	cameraFrames = cameraCount ? &ownFrames[0] : NULL;
+	nearVals = cameraCount ? &ownNear[0] : NULL;
+	farVals = cameraCount ? &ownFar[0] : NULL;
+	projections = cameraCount ? &ownProjections[0] : NULL;
+	bundles = trackCount ? &ownBundles[0] : NULL;
+	enabledFrames = trackCount ? &ownEnabled[0] : NULL;
+	return true;
+}
+
+// check that an array of count elements of the given size fits into the mapped file
+bool Scene::fits(uint64_t offset, uint64_t count, size_t elementSize) const
+{
+	return offset <= mappingSize && count * elementSize <= mappingSize - offset;
+}
+
+// map a compiled scene; fails if the file is missing, damaged or compiled from a different YAML file
+// the arrays are used directly from the mapped memory, nothing is copied
+bool Scene::loadCompiled(const char *fileName, uint64_t yamlHash)
+{
+	int fd = open(fileName, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size < sizeof(SceneHeader)) {
+		close(fd);
+		return false;
+	}
+	// private writable mapping: the matrices built on top of it may be modified without touching the file
+	void *data = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	mapping = data;
+	mappingSize = info.st_size;
+
+	const SceneHeader *header = (const SceneHeader*)data;
+	const char *base = (const char*)data;
+	if (memcmp(header->magic, sceneMagic, sizeof(sceneMagic)) != 0 || header->version != sceneVersion || header->yamlHash != yamlHash ||
+	    header->cameraCount < 0 || header->trackCount < 0 || header->frameWords < 0 || header->pathLength < 0 || header->distortionCount < 0 ||
+	    !fits(header->pathOffset, header->pathLength, 1) ||
+	    !fits(header->distortionOffset, header->distortionCount, sizeof(float)) ||
+	    !fits(header->cameraFramesOffset, header->cameraCount, sizeof(int32_t)) ||
+	    !fits(header->nearOffset, header->cameraCount, sizeof(float)) ||
+	    !fits(header->farOffset, header->cameraCount, sizeof(float)) ||
+	    !fits(header->projectionsOffset, header->cameraCount, 16*sizeof(float)) ||
+	    !fits(header->bundlesOffset, header->trackCount, 4*sizeof(float)) ||
+	    !fits(header->enabledOffset, (uint64_t)header->trackCount * header->frameWords, sizeof(uint64_t))) {
+		munmap(mapping, mappingSize);
+		mapping = NULL;
+		mappingSize = 0;
+		return false;
+	}
+
+	width = header->width;
+	height = header->height;
+	centerX = header->centerX;
+	centerY = header->centerY;
+	fov = header->fov;
+	clipPath.assign(base + header->pathOffset, header->pathLength);
+	const float *distortionData = (const float*)(base + header->distortionOffset);
+	distortion.assign(distortionData, distortionData + header->distortionCount);
+	cameraCount = header->cameraCount;
+	trackCount = header->trackCount;
+	frameWords = header->frameWords;
+	cameraFrames = (const int32_t*)(base + header->cameraFramesOffset);
+	nearVals = (const float*)(base + header->nearOffset);
+	farVals = (const float*)(base + header->farOffset);
+	projections = (const float*)(base + header->projectionsOffset);
+	bundles = (const float*)(base + header->bundlesOffset);
+	enabledFrames = (const uint64_t*)(base + header->enabledOffset);
+	return true;
+}
+
+// append an array to the file, padded to a multiple of 8 bytes; returns its offset
+static uint64_t writeArray(FILE *file, const void *data, size_t size, bool &ok)
+{
+	static const char zeros[8] = {0};
+	uint64_t offset = ftello(file);
+	if (size > 0)
+		ok = ok && fwrite(data, 1, size, file) == size;
+	if (size % 8)
+		ok = ok && fwrite(zeros, 1, 8 - size%8, file) == 8 - size%8;
+	return offset;
+}
+
+// write the scene in the compiled format, to be loaded by loadCompiled with the same hash
+bool Scene::saveCompiled(const char *fileName, uint64_t yamlHash) const
+{
+	FILE *file = fopen(fileName, "wb");
+	if (!file)
+		return false;
+	SceneHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, sceneMagic, sizeof(sceneMagic));
+	header.version = sceneVersion;
+	header.width = width;
+	header.height = height;
+	header.centerX = centerX;
+	header.centerY = centerY;
+	header.fov = fov;
+	header.yamlHash = yamlHash;
+	header.pathLength = clipPath.size();
+	header.distortionCount = distortion.size();
+	header.cameraCount = cameraCount;
+	header.trackCount = trackCount;
+	header.frameWords = frameWords;
+
+	// the header is written twice: first as a placeholder, then with the offsets filled in
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	header.pathOffset = writeArray(file, clipPath.data(), clipPath.size(), ok);
+	header.distortionOffset = writeArray(file, distortion.empty() ? NULL : &distortion[0], distortion.size() * sizeof(float), ok);
+	header.cameraFramesOffset = writeArray(file, cameraFrames, cameraCount * sizeof(int32_t), ok);
+	header.nearOffset = writeArray(file, nearVals, cameraCount * sizeof(float), ok);
+	header.farOffset = writeArray(file, farVals, cameraCount * sizeof(float), ok);
+	header.projectionsOffset = writeArray(file, projections, cameraCount * 16 * sizeof(float), ok);
+	header.bundlesOffset = writeArray(file, bundles, trackCount * 4 * sizeof(float), ok);
+	header.enabledOffset = writeArray(file, enabledFrames, (size_t)trackCount * frameWords * sizeof(uint64_t), ok);
+	ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = (fclose(file) == 0) && ok;
+	if (!ok)
+		remove(fileName);
+	return ok;
+}
+
+// check if the given track is enabled in the given frame (counted from 0, including the skipped ones)
+bool Scene::enabled(int track, int frame) const
+{
+	if (frame < 0 || frame >= frameWords * 64)
+		return false;
+	return (enabledFrames[track*frameWords + frame/64] >> (frame%64)) & 1;
+}
@@ -0,0 +1,94 @@
+// trace.cpp: timing of the individual stages, saved in the Chrome trace format
+// the output can be opened in chrome://tracing or https://ui.perfetto.dev
+
+#include "recon.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+
+bool traceEnabled = false;
+
+// a single finished TraceScope
+typedef struct {
+	const char *name;
+	double start, end; // in microseconds
+	int thread, mainFrame, sideFrame;
+} TraceEvent;
+
+static const char *traceFileName = NULL;
+static std::vector<TraceEvent> traceEvents;
+static Monitor traceLock; // guards traceEvents and threadCounter
+static int threadCounter = 0;
+
+// per-thread data: a small sequential thread number and the frames being processed
+static __thread int traceThread = -1, traceMain = -1, traceSide = -1;
+
+// monotonic time in microseconds
+double traceClock()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e6 + now.tv_nsec * 1e-3;
+}
+
+// start collecting events; they will be saved by finishTrace(), at the latest when the program exits
+void startTrace(const char *fileName)
+{
+	traceFileName = fileName;
+	traceEvents.reserve(4096);
+	traceEnabled = true;
+	atexit(finishTrace);
+}
+
+// record a scope that started at the given time and has just ended
+void traceEvent(const char *name, double start)
+{
+	TraceEvent event;
+	event.name = name;
+	event.start = start;
+	event.end = traceClock();
+	event.mainFrame = traceMain;
+	event.sideFrame = traceSide;
+	MonitorLock lock(traceLock);
+	if (traceThread < 0)
+		traceThread = threadCounter++;
+	event.thread = traceThread;
+	traceEvents.push_back(event);
+}
+
+// set the frames being processed by the calling thread, to be recorded with each event
+void setTraceFrames(int mainFrame, int sideFrame)
+{
+	traceMain = mainFrame;
+	traceSide = sideFrame;
+}
+
+void getTraceFrames(int *mainFrame, int *sideFrame)
+{
+	*mainFrame = traceMain;
+	*sideFrame = traceSide;
+}
+
+// write all the collected events as complete ('X') events of a single process
+void finishTrace()
+{
+	if (!traceEnabled)
+		return;
+	traceEnabled = false;
+	MonitorLock lock(traceLock);
+	FILE *file = fopen(traceFileName, "w");
+	if (!file) {
+		fprintf(stderr, "Cannot write trace file %s.\n", traceFileName);
+		return;
+	}
+	fprintf(file, "{\"traceEvents\":[\n");
+	for (int i=0; i<traceEvents.size(); i++) {
+		const TraceEvent &event = traceEvents[i];
+		fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%.1f,\"dur\":%.1f,\"args\":{\"main\":%i,\"side\":%i}}%s\n",
+			event.name, event.thread, event.start, event.end - event.start, event.mainFrame, event.sideFrame,
+			(i+1 < traceEvents.size()) ? "," : "");
+	}
+	fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(file);
+	traceEvents.clear();
+}
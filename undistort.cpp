@@ -0,0 +1,102 @@
+// undistort.cpp: the remap table removing the lens distortion from the frames of the clip
+// built once per clip and cached in a file, because it is the same for every frame
+
+#include "recon.hpp"
+#include <opencv2/imgproc/imgproc.hpp>
+#include <cstdio>
+#include <cstring>
+
+// the cache file starts with this header, followed by the x and y maps as raw floats, row by row
+const char undistortMagic[8] = {'R','E','C','O','N','U','D','M'};
+const int32_t undistortVersion = 1;
+typedef struct {
+	char magic[8];
+	int32_t version, width, height, sourceWidth, sourceHeight;
+	float centerX, centerY, k1, k2;
+} UndistortHeader;
+
+static void fillHeader(UndistortHeader &header, const std::vector<float> &distortion, int width, int height, int sourceWidth, int sourceHeight, float centerX, float centerY)
+{
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, undistortMagic, sizeof(undistortMagic));
+	header.version = undistortVersion;
+	header.width = width;
+	header.height = height;
+	header.sourceWidth = sourceWidth;
+	header.sourceHeight = sourceHeight;
+	header.centerX = centerX;
+	header.centerY = centerY;
+	header.k1 = (distortion.size() > 0) ? distortion[0] : 0;
+	header.k2 = (distortion.size() > 1) ? distortion[1] : 0;
+}
+
+// read the maps if the file was written with exactly the same parameters
+static bool loadMaps(const char *fileName, const UndistortHeader &expected, Mat &mapX, Mat &mapY)
+{
+	FILE *file = fopen(fileName, "rb");
+	if (!file)
+		return false;
+	UndistortHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(&header, &expected, sizeof(header)) == 0;
+	if (ok) {
+		mapX.create(header.height, header.width, CV_32FC1);
+		mapY.create(header.height, header.width, CV_32FC1);
+		ok = fread(mapX.data, sizeof(float), mapX.total(), file) == mapX.total() &&
+		     fread(mapY.data, sizeof(float), mapY.total(), file) == mapY.total();
+	}
+	fclose(file);
+	return ok;
+}
+
+static void saveMaps(const char *fileName, const UndistortHeader &header, const Mat mapX, const Mat mapY)
+{
+	FILE *file = fopen(fileName, "wb");
+	if (!file)
+		return;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+	          fwrite(mapX.data, sizeof(float), mapX.total(), file) == mapX.total() &&
+	          fwrite(mapY.data, sizeof(float), mapY.total(), file) == mapY.total();
+	ok = (fclose(file) == 0) && ok;
+	if (!ok)
+		remove(fileName);
+}
+
+// for each pixel of the undistorted frame (of size width x height), find its position in the distorted source frame
+// the distortion is the same as in cameraToScreen, in screen coordinates relative to the principal point
+// the downscaling is folded into the same table, so that each frame gets remapped just once
+static void buildMaps(const UndistortHeader &header, Mat &mapX, Mat &mapY)
+{
+	float aspect = (float)header.height / (float)header.width,
+	      scaleX = (float)header.sourceWidth / (float)header.width,
+	      scaleY = (float)header.sourceHeight / (float)header.height;
+	mapX.create(header.height, header.width, CV_32FC1);
+	mapY.create(header.height, header.width, CV_32FC1);
+	for (int row=0; row<header.height; row++) {
+		float *mx = mapX.ptr<float>(row), *my = mapY.ptr<float>(row);
+		for (int col=0; col<header.width; col++) {
+			float x = (col - header.centerX) / (header.width*0.5),
+			      y = (header.height - header.centerY - row) / (header.height*0.5);
+			float radSquared = (x*x + y*y*aspect*aspect)/4;
+			float k = 1 + radSquared * (header.k1 + radSquared * header.k2);
+			float distortedCol = header.centerX + k*x*header.width*0.5,
+			      distortedRow = header.height - header.centerY - k*y*header.height*0.5;
+			// align the pixel centers of both resolutions
+			mx[col] = (distortedCol + 0.5) * scaleX - 0.5;
+			my[col] = (distortedRow + 0.5) * scaleY - 0.5;
+		}
+	}
+}
+
+// get the remap table from the given cache file, or build it and save it there
+// map1 and map2 are in the fixed-point format of cv::convertMaps, which remaps faster than floats
+void undistortionMaps(const char *cacheFile, const std::vector<float> &distortion, int width, int height, int sourceWidth, int sourceHeight, float centerX, float centerY, Mat &map1, Mat &map2)
+{
+	UndistortHeader header;
+	fillHeader(header, distortion, width, height, sourceWidth, sourceHeight, centerX, centerY);
+	Mat mapX, mapY;
+	if (!loadMaps(cacheFile, header, mapX, mapY)) {
+		buildMaps(header, mapX, mapY);
+		saveMaps(cacheFile, header, mapX, mapY);
+	}
+	cv::convertMaps(mapX, mapY, map1, map2, CV_16SC2);
+}
@@ -164,14 +164,18 @@ DensityPoint triangulatePixel(float x, float y, const Mat measuredPoints, const
 }
 
 // Triangulate all available pixels of the main camera's frame
-Mat triangulatePixels(const MatList flows, const Mat mainCamera, const MatList cameras, const Mat depth)
+// the i-th flow belongs to the i-th side frame; the matrices are taken from the camera table
+void triangulatePixels(PointStore &cloud, const MatList flows, const CameraTable &table, int mainFrame, const std::vector<int> &sideFrames, const Mat depth)
 {
+	TraceScope trace("triangulatePixels");
 	int width = depth.cols, height = depth.rows;
 	
-	// point \in P^3, normal (scaled by probability) \in R^3
-	Mat points(depth.rows*depth.cols, 4+3, CV_32FC1);
-	int pixelId=0;
-	Mat mainCameraInv = mainCamera.inv();
+	// point \in P^3, normal (scaled by probability) \in R^3, filled in later
+	const float noNormal[3] = {0, 0, 0};
+	Mat mainCameraInv = table.inverse(mainFrame);
+	MatList cameras;
+	for (int i=0; i<sideFrames.size(); i++)
+		cameras.push_back(table.projection(sideFrames[i]));
 	#ifdef USE_COVAR_MATRICES
 	Mat gradient = imageGradient(depth);
 	#endif
@@ -235,26 +239,22 @@ Mat triangulatePixels(const MatList flows, const Mat mainCamera, const MatList c
 				}}
 				if (okay) {
 					DensityPoint result = triangulatePixel(x, y, measuredPoints, invVariances, mainCameraInv, cameras, depthRow[col]);
-					points.row(pixelId).colRange(0,4) = result.point.t();
+					const float point[4] = {result.point.at<float>(0), result.point.at<float>(1), result.point.at<float>(2), result.point.at<float>(3)};
 					// save the density of the point to be processed later in this function
-					points.at<float>(pixelId, 4) = result.density;
-					pixelIndices.at<int32_t>(row, col) = pixelId;
-					pixelId ++;
+					pixelIndices.at<int32_t>(row, col) = cloud.size();
+					cloud.append(point, noNormal, result.density);
 				}
 			}
 		}
 	}
-	// release unnecessary matrix rows
-	points.resize(pixelId);
-	
 	// == BEGIN Estimate normals from neighborhood in the main frame ==
 
 	// half size of the square neighborhood to be considered
 	const int radius = 10;
 	// centers of all side cameras, used to obtain correct normal orientation
-	std::vector<Mat> cameraCenters(1, extractCameraCenter(mainCamera));
-	for (MatList::const_iterator camera=cameras.begin(); camera!=cameras.end(); camera++) {
-		cameraCenters.push_back(extractCameraCenter(*camera));
+	std::vector<Mat> cameraCenters(1, table.center(mainFrame));
+	for (int i=0; i<sideFrames.size(); i++) {
+		cameraCenters.push_back(table.center(sideFrames[i]));
 	}
 	for (int i=0; i<cameraCenters.size(); i++) {
 		cameraCenters[i] = cameraCenters[i].rowRange(0, 3).t() / cameraCenters[i].at<float>(3);
@@ -273,10 +273,12 @@ Mat triangulatePixels(const MatList flows, const Mat mainCamera, const MatList c
 				continue;
 			
 			// the density value as calculated previously
-			float pdf = points.at<float>(pixelId, 4);
+			float pdf = cloud.at(pixelId, PointStore::pointDensity);
 			// wild guess: normalize pdf per side camera -> nth root
 			if (cameras.size() > 1)
 				pdf = pow(pdf, 1.0/cameras.size());
+			Mat position = (cv::Mat_<float>(1, 3) << cloud.at(pixelId, PointStore::posX), cloud.at(pixelId, PointStore::posY), cloud.at(pixelId, PointStore::posZ));
+			float w = cloud.at(pixelId, PointStore::posW);
 			
 			// add all neighbor points to the neighborhood matrix
 			for (int ny=row-radius; ny<=row+radius; ny++) {
@@ -287,8 +289,10 @@ Mat triangulatePixels(const MatList flows, const Mat mainCamera, const MatList c
 					// check that a point corresponding to this neighbor exists
 					if (nx < 0 || nx >= width || idRow[nx] < 0)
 						continue;
-					Mat point = points.row(idRow[nx]).colRange(0,3) / points.at<float>(idRow[nx], 3);
-					neighborhood.push_back(point);
+					int id = idRow[nx];
+					float nw = cloud.at(id, PointStore::posW);
+					float point[3] = {cloud.at(id, PointStore::posX) / nw, cloud.at(id, PointStore::posY) / nw, cloud.at(id, PointStore::posZ) / nw};
+					neighborhood.push_back(Mat(1, 3, CV_32FC1, point));
 				}
 			}
 			
@@ -302,7 +306,7 @@ Mat triangulatePixels(const MatList flows, const Mat mainCamera, const MatList c
 				float dot;
 				for (int i=0; i<cameraCenters.size(); i++) {
 					// weighting of cameras inversely to distance
-					dot += 1/normal.dot(cameraCenters[i] - points.row(pixelId).colRange(0,3) / points.at<float>(pixelId, 3));
+					dot += 1/normal.dot(cameraCenters[i] - position / w);
 				}
 				
 				// if the majority of the cameras views the normal from the back, flip it
@@ -315,40 +319,30 @@ Mat triangulatePixels(const MatList flows, const Mat mainCamera, const MatList c
 				// if not enough neighbors available, try to guess a normal from the camera centers
 				normal = Mat::zeros(1, 3, CV_32FC1);
 				for (int i=0; i<cameraCenters.size(); i++) {
-					Mat vec = cameraCenters[i] - points.row(pixelId).colRange(0,3);
+					Mat vec = cameraCenters[i] - position;
 					normal += vec / vec.dot(vec);
 				}
 			}
 			
 			// normalize the normal and scale it according to the triangulation probability
-			points.row(pixelId).colRange(4,7) = normal * pdf / cv::norm(normal);
+			normal = normal * pdf / cv::norm(normal);
+			cloud.at(pixelId, PointStore::normalX) = normal.at<float>(0);
+			cloud.at(pixelId, PointStore::normalY) = normal.at<float>(1);
+			cloud.at(pixelId, PointStore::normalZ) = normal.at<float>(2);
+			cloud.at(pixelId, PointStore::pointDensity) = pdf;
 		}
 	}
-
-	return points;
 }
 
 // estimate the variance given a reference image and an image remapped by the optical flow
-Mat compare(const Mat prev, const Mat next)
+Mat compare(const FramePyramid &prev, const FramePyramid &next)
 {
-	std::vector<Mat> diffPyramid;
-	int size = (prev.rows < prev.cols) ? prev.rows : prev.cols;
-	Mat a, b;
-	prev.convertTo(a, CV_32FC1);
-	next.convertTo(b, CV_32FC1);
+	assert(prev.levels.size() == next.levels.size());
+	std::vector<Mat> diffPyramid(prev.levels.size());
 	
-	// go up the pyramid and calculate the L1 difference between the downscaled versions of the images
-	while (1) {
-		Mat diff;
-		cv::absdiff(a, b, diff);
-		diffPyramid.push_back(diff);
-		if (size <= 2)
-			// repeat until the topmost level of the pyramid
-			break;
-		cv::pyrDown(a, a);
-		cv::pyrDown(b, b);
-		size /= 2;
-	}
+	// calculate the L1 difference between the downscaled versions of the images on each level of the pyramid
+	for (int i=0; i<diffPyramid.size(); i++)
+		cv::absdiff(prev.levels[i], next.levels[i], diffPyramid[i]);
 	
 	// go down and sum up all the differences to each pixel
 	for (int i=diffPyramid.size()-2; i>=0; i--) {
@@ -432,6 +426,79 @@ float sampleImage(const Mat image, float radiusSquared, const float x, const flo
 	}
 }
 
+// Summed-area tables of the given channel and of its pixels that are neither under- nor overexposed (only those are summed)
+// as from cv::integral, with an extra leading row and column of zeros
+void validIntegrals(const Mat image, char channel, Mat &sums, Mat &counts)
+{
+	assert (image.depth() == CV_8U);
+	char ch = image.channels();
+	Mat masked(image.rows, image.cols, CV_8UC1), valid(image.rows, image.cols, CV_8UC1);
+	for (int y=0; y<image.rows; y++) {
+		const uchar *row = image.ptr<uchar>(y);
+		uchar *maskedRow = masked.ptr<uchar>(y), *validRow = valid.ptr<uchar>(y);
+		for (int x=0; x<image.cols; x++) {
+			uchar val = row[x*ch + channel];
+			validRow[x] = (val > 0 && val < 255);
+			maskedRow[x] = validRow[x] ? val : 0;
+		}
+	}
+	cv::integral(masked, sums, CV_32S);
+	cv::integral(valid, counts, CV_32S);
+}
+
+// sum of the rectangle of pixels [x0, x1] x [y0, y1] from a summed-area table
+static inline int32_t integralRect(const Mat integral, int x0, int y0, int x1, int y1)
+{
+	return integral.at<int32_t>(y1+1, x1+1) - integral.at<int32_t>(y0, x1+1) - integral.at<int32_t>(y1+1, x0) + integral.at<int32_t>(y0, x0);
+}
+
+// Same as sampleImage(image, radiusSquared, x, y, channel), using the tables prepared by validIntegrals
+// each row of the disk is a span found exactly by the same test as in sampleImage;
+// consecutive rows with the same span form a single rectangle, read from the tables in constant time
+float sampleDisk(const Mat sums, const Mat counts, float radiusSquared, const float x, const float y)
+{
+	int rows = sums.rows - 1, cols = sums.cols - 1;
+	int32_t sum = 0, weightSum = 0;
+	float radius = sqrt(radiusSquared);
+	int runX0 = 0, runX1 = -1, runY0 = 0, runY1 = -1; // the rectangle being extended, empty at first
+	for (int ny = (int)MAX(0, y - radius); ny < MIN(y + radius + 1, rows); ny++) {
+		float dy = ny - y;
+		float halfWidthSquared = radiusSquared - dy*dy;
+		if (halfWidthSquared < 0)
+			continue;
+		float halfWidth = sqrt(halfWidthSquared);
+		int x0 = ceil(x - halfWidth), x1 = floor(x + halfWidth);
+		// correct the rounding errors of the square root
+		while ((x0-1-x)*(x0-1-x) + dy*dy <= radiusSquared) x0--;
+		while (x0 <= x1 && (x0-x)*(x0-x) + dy*dy > radiusSquared) x0++;
+		while ((x1+1-x)*(x1+1-x) + dy*dy <= radiusSquared) x1++;
+		while (x1 >= x0 && (x1-x)*(x1-x) + dy*dy > radiusSquared) x1--;
+		x0 = MAX(x0, 0);
+		x1 = MIN(x1, cols - 1);
+		if (x0 > x1)
+			continue;
+		if (x0 == runX0 && x1 == runX1 && ny == runY1 + 1) {
+			runY1 = ny;
+			continue;
+		}
+		if (runX0 <= runX1 && runY0 <= runY1) {
+			sum += integralRect(sums, runX0, runY0, runX1, runY1);
+			weightSum += integralRect(counts, runX0, runY0, runX1, runY1);
+		}
+		runX0 = x0;
+		runX1 = x1;
+		runY0 = runY1 = ny;
+	}
+	if (runX0 <= runX1 && runY0 <= runY1) {
+		sum += integralRect(sums, runX0, runY0, runX1, runY1);
+		weightSum += integralRect(counts, runX0, runY0, runX1, runY1);
+	}
+	if (weightSum > 0)
+		return (float)sum / weightSum;
+	else
+		return -1;
+}
+
 // Sample any data type as required from the image by bilinear interpolation (used for sampling the gradient)
 // x, y: coordinates pointing directly into pixel grid, pixel coordinates are in their corners
 // WARNING: throws an error if coordinates are out of image domain
@@ -484,16 +551,23 @@ void saveImage(const Mat image, const char *fileName)
 	saveImage(image, fileName, false);
 }
 
+// Save the image in background if the debug sink is running, or directly otherwise
+void saveImage(const Mat image, const char *fileName, bool normalize)
+{
+	if (!queueDebugImage(image, fileName, normalize))
+		writeImage(image, fileName, normalize);
+}
+
 // Wrapper for the OpenCV function
 // optionally applies normalization: scales and translates the values so that they fit 0..255 range, all channels by the same mapping
-void saveImage(const Mat image, const char *fileName, bool normalize)
+void writeImage(const Mat image, const char *fileName, bool normalize)
 {
 	// if the suppliad image has an unsuitable number of channels, extend or remove them
 	if (image.channels() > 1 && image.channels() != 3) {
 		Mat bgr(image.rows, image.cols, CV_32FC3);
 		int from_to[] = {-1,0, 0,1, 1,2};
 		mixChannels(&image, 1, &bgr, 1, from_to, 3);
-		saveImage(bgr, fileName, normalize);
+		writeImage(bgr, fileName, normalize);
 		return;
 	}
 	
@@ -565,17 +639,46 @@ Mesh readMesh(const char *fileName)
 	return mesh;
 }
 
+// save the positions of all points as vertices of an .obj file
+void savePoints(const PointStore &points, const char *fileName)
+{
+	// a copy in the matrix format is still much faster than formatting the text here
+	if (queueDebugPoints(points, fileName))
+		return;
+	FILE *file = fopen(fileName, "w");
+	if (!file) {
+		fprintf(stderr, "Cannot write %s.\n", fileName);
+		return;
+	}
+	for (int b=0; b<points.blockCount(); b++) {
+		const float *x = points.column(b, PointStore::posX), *y = points.column(b, PointStore::posY),
+		            *z = points.column(b, PointStore::posZ), *w = points.column(b, PointStore::posW);
+		for (int i=0; i<points.blockLength(b); i++)
+			fprintf(file, "v %g %g %g\n", x[i]/w[i], y[i]/w[i], z[i]/w[i]);
+	}
+	fclose(file);
+}
+
 // save the given mesh as a simple OBJ format
+// in background if the debug sink is running, or directly otherwise
 void saveMesh(const Mesh mesh, const char *fileName)
+{
+	if (!queueDebugMesh(mesh, fileName))
+		writeMesh(mesh, fileName);
+}
+
+// write the OBJ file in the calling thread
+void writeMesh(const Mesh mesh, const char *fileName)
 {
 	std::ofstream os(fileName);
+	// note that std::endl would flush the stream after each line
 	for(int i=0; i < mesh.vertices.rows; i ++) {
 		const float* row = mesh.vertices.ptr<float>(i);
-		os << "v " << row[0]/row[3] << ' ' << row[1]/row[3] << ' ' << row[2]/row[3] << std::endl;
+		os << "v " << row[0]/row[3] << ' ' << row[1]/row[3] << ' ' << row[2]/row[3] << '\n';
 	}
 	for (int i=0; i < mesh.faces.rows; i++){
 		const int32_t* row = mesh.faces.ptr<int32_t>(i);
-		os << "f " << row[0]+1 << ' ' << row[1]+1 << ' ' << row[2]+1 << std::endl;
+		os << "f " << row[0]+1 << ' ' << row[1]+1 << ' ' << row[2]+1 << '\n';
 	}
 	os.close();
 }
@@ -0,0 +1,58 @@
+// visibility.cpp: which tracks are enabled in which frames, as a sparse matrix
+
+#include "recon.hpp"
+
+Visibility::Visibility()
+{
+	frameCount = trackCount = words = 0;
+	frameStart.assign(1, 0);
+	trackStart.assign(1, 0);
+}
+
+// collect the enabled frames of each track of the scene, keeping only the given frames of the clip
+// frames are renumbered to count only the kept ones: frame i is the frame clipFrames[i] of the clip
+void Visibility::build(const Scene &scene, const std::vector<int> &clipFrames)
+{
+	frameCount = clipFrames.size();
+	trackCount = scene.trackCount;
+	words = (frameCount + 63) / 64;
+	bits.assign((size_t)trackCount * words, 0);
+
+	// CSR by track, and the bitset at the same time
+	trackStart.assign(trackCount + 1, 0);
+	trackFrames.clear();
+	std::vector<int> perFrame(frameCount, 0);
+	for (int j=0; j<trackCount; j++) {
+		trackStart[j] = trackFrames.size();
+		for (int fi=0; fi<frameCount; fi++) {
+			if (!scene.enabled(j, clipFrames[fi]))
+				continue;
+			trackFrames.push_back(fi);
+			perFrame[fi] ++;
+			bits[(size_t)j*words + fi/64] |= (uint64_t)1 << (fi%64);
+		}
+	}
+	trackStart[trackCount] = trackFrames.size();
+
+	// CSR by frame: count, prefix sums, then fill in the order of tracks so that each row is sorted
+	frameStart.assign(frameCount + 1, 0);
+	for (int fi=0; fi<frameCount; fi++)
+		frameStart[fi+1] = frameStart[fi] + perFrame[fi];
+	frameTracks.resize(trackFrames.size());
+	trackEntries.resize(trackFrames.size());
+	std::vector<int> fill(frameStart.begin(), frameStart.end() - 1);
+	for (int j=0; j<trackCount; j++) {
+		for (int t=trackStart[j]; t<trackStart[j+1]; t++) {
+			int k = fill[trackFrames[t]]++;
+			frameTracks[k] = j;
+			trackEntries[t] = k;
+		}
+	}
+}
+
+bool Visibility::visible(int track, int frame) const
+{
+	if (frame < 0 || frame >= frameCount)
+		return false;
+	return (bits[(size_t)track*words + frame/64] >> (frame%64)) & 1;
+}